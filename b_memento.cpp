@@ -15,14 +15,159 @@
 #include <vector>
 #include <list>
 #include <limits>
+#include <deque>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <algorithm>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <ctime>
+#include <charconv>
+#include <system_error>
+#include <fstream>
+
+//#define RUN_BENCHMARK       // run the benchmarks instead of the interactive demo
 
 #define MAX_NUM_UNDO  100     // maximum number of undo that can be performed.
 
+#define PAGE_SIZE     4096    // bytes per PagedData page
+
 class Memento;
 
+// Copy-on-write paged byte array. The pages hang off a persistent radix tree, TABLE_FANOUT slots per
+// node. Copies share the tree and the pages, a write through a copy that shares them copies the page
+// and the nodes on the path down to it, the rest of the tree stays shared. Copying is O(1), and a copy
+// that wrote k pages since owns about k pages plus k * depth nodes, whatever the size of the data.
+#define TABLE_BITS    4                  // a table node has 2^TABLE_BITS slots
+#define TABLE_FANOUT  (1 << TABLE_BITS)
+
+class PagedData {
+    public:
+        PagedData() = default;
+        explicit PagedData(std::size_t size) : m_size{size}, m_pages{(size + PAGE_SIZE - 1) / PAGE_SIZE} {
+            if(size == 0)
+                return;
+            m_depth = 1;
+            while((std::size_t(1) << (TABLE_BITS * m_depth)) < m_pages)
+                m_depth++;
+            m_root = build(m_depth, 0);
+        }
+
+        std::size_t size() const {return m_size;}
+        std::size_t num_pages() const {return m_pages;}
+        const unsigned char *page(std::size_t p) const {return static_cast<const Page *>(leaf(p))->bytes;}
+        std::size_t page_size(std::size_t p) const {return std::min<std::size_t>(PAGE_SIZE, m_size - p * PAGE_SIZE);}
+        bool same_page(const PagedData &other, std::size_t p) const {return leaf(p) == other.leaf(p);}
+        // Appends the table nodes of this copy, copies share the nodes they did not write through.
+        void table_nodes(std::vector<const void *> &nodes) const {
+            if(m_root)
+                collect(m_root.get(), m_depth, nodes);
+        }
+        static constexpr std::size_t table_node_bytes() {return sizeof(TableNode);}
+
+        // Writable page, copied first, with the table nodes above it, when someone else still shares it.
+        unsigned char *mutable_page(std::size_t p) {
+            std::shared_ptr<void> *slot = &m_root;
+            for(int level = m_depth; level > 0; level--){
+                if(slot->use_count() > 1)
+                    *slot = std::make_shared<TableNode>(*static_cast<TableNode *>(slot->get()));
+                slot = &static_cast<TableNode *>(slot->get())->slots[(p >> (TABLE_BITS * (level - 1))) & (TABLE_FANOUT - 1)];
+            }
+            if(slot->use_count() > 1)
+                *slot = std::make_shared<Page>(*static_cast<Page *>(slot->get()));
+            return static_cast<Page *>(slot->get())->bytes;
+        }
+
+        void write(std::size_t pos, const void *src, std::size_t len) {
+            const unsigned char *from = static_cast<const unsigned char *>(src);
+            for_range(pos, len, [this, &from](std::size_t p, std::size_t off, std::size_t n){
+                std::memcpy(mutable_page(p) + off, from, n);
+                from += n;
+            });
+        }
+
+        void fill(std::size_t pos, unsigned char value, std::size_t len) {
+            for_range(pos, len, [this, value](std::size_t p, std::size_t off, std::size_t n){
+                std::memset(mutable_page(p) + off, value, n);
+            });
+        }
+
+        void read(std::size_t pos, void *dst, std::size_t len) const {
+            unsigned char *to = static_cast<unsigned char *>(dst);
+            for_range(pos, len, [this, &to](std::size_t p, std::size_t off, std::size_t n){
+                std::memcpy(to, page(p) + off, n);
+                to += n;
+            });
+        }
+
+    private:
+        struct Page {
+            unsigned char bytes[PAGE_SIZE];
+        };
+        // A slot holds a TableNode above the bottom level and a Page at the bottom level.
+        struct TableNode {
+            std::shared_ptr<void> slots[TABLE_FANOUT];
+        };
+
+        // The pages of the subtree of a node at level that starts at page first.
+        std::shared_ptr<void> build(int level, std::size_t first) const {
+            if(level == 0)
+                return std::make_shared<Page>();
+            std::shared_ptr<TableNode> node = std::make_shared<TableNode>();
+            std::size_t span = std::size_t(1) << (TABLE_BITS * (level - 1));
+            for(int i = 0; i < TABLE_FANOUT && first + i * span < m_pages; i++)
+                node->slots[i] = build(level - 1, first + i * span);
+            return node;
+        }
+
+        static void collect(const void *node, int level, std::vector<const void *> &nodes) {
+            nodes.push_back(node);
+            if(level > 1)
+                for(const std::shared_ptr<void> &slot : static_cast<const TableNode *>(node)->slots)
+                    if(slot)
+                        collect(slot.get(), level - 1, nodes);
+        }
+
+        const void *leaf(std::size_t p) const {
+            const void *node = m_root.get();
+            for(int level = m_depth; level > 0; level--)
+                node = static_cast<const TableNode *>(node)->slots[(p >> (TABLE_BITS * (level - 1))) & (TABLE_FANOUT - 1)].get();
+            return node;
+        }
+
+        // Split [pos, pos + len) at page boundaries.
+        template <typename F>
+        static void for_range(std::size_t pos, std::size_t len, F f) {
+            while(len){
+                std::size_t off = pos % PAGE_SIZE;
+                std::size_t n = std::min(len, PAGE_SIZE - off);
+                f(pos / PAGE_SIZE, off, n);
+                pos += n;
+                len -= n;
+            }
+        }
+
+        std::shared_ptr<void> m_root;
+        std::size_t m_size = 0;
+        std::size_t m_pages = 0;
+        int m_depth = 0;                 // table levels above the pages
+};
+
 class Object {
     public:
-        Object(int i) : m_accum{i}{}
+        Object(int i, std::size_t data_size = 0) : m_accum{i}, m_data(data_size){}
 
         void func1(int x){          // addition
             m_accum += x;
@@ -35,119 +180,1275 @@ class Object {
         std::unique_ptr<Memento> createMemento() const { 
             return std::make_unique<Memento>(*this);
         }
+        void saveMemento(Memento &mem) const;     // same, into an existing memento
 
         void set_accum(int sum){m_accum = sum;}
-        int get_accum(){return m_accum;}
+        int get_accum() const {return m_accum;}
+
+        // The rest of the object state, a real object carries megabytes of it. Copying an Object is O(1), 
+        // the copies share the data pages until one of them writes.
+        std::size_t data_size() const {return m_data.size();}
+        const PagedData &data() const {return m_data;}
+        PagedData &data() {return m_data;}
         
     private:
         int m_accum;
+        PagedData m_data;
 };
 
 class Memento { 
     public:
+        Memento() : m_object{0}{}
         Memento(Object obj) 
             : m_object{obj}{}
 
         Object m_object;
 };
 
+void Object::saveMemento(Memento &mem) const {
+    mem.m_object = *this;           // O(1), shares the data pages
+}
+
+// Fixed capacity ring, all slots are allocated up front. push_back() overwrites the oldest entry once the 
+// ring is full, slots are reused by assignment so nothing is allocated in steady state.
+template <typename T>
+class RingBuffer {
+    public:
+        explicit RingBuffer(std::size_t capacity) : m_slots(capacity ? capacity : 1){}
+
+        // Returns the slot for the new newest entry, still holding whatever was in it before.
+        T &push_back() {
+            if(m_size == m_slots.size()){
+                m_head = next(m_head);
+                m_size--;
+            }
+            T &slot = m_slots[(m_head + m_size) % m_slots.size()];
+            m_size++;
+            return slot;
+        }
+        void push_back(const T &item) { push_back() = item; }
+
+        void pop_back() { m_size--; }
+        void pop_front() { m_head = next(m_head); m_size--; }
+        void clear() { m_head = 0; m_size = 0; }
+
+        T &back() { return m_slots[(m_head + m_size - 1) % m_slots.size()]; }
+        T &front() { return m_slots[m_head]; }
+        T &operator[](std::size_t i) { return m_slots[(m_head + i) % m_slots.size()]; }   // 0 is the oldest
+
+        std::size_t size() const { return m_size; }
+        std::size_t capacity() const { return m_slots.size(); }
+        bool empty() const { return m_size == 0; }
+        bool full() const { return m_size == m_slots.size(); }
+
+    private:
+        std::size_t next(std::size_t i) const { return i + 1 == m_slots.size() ? 0 : i + 1; }
+
+        std::vector<T> m_slots;
+        std::size_t m_head = 0;       // oldest entry
+        std::size_t m_size = 0;
+};
+
+// A memento that only keeps the byte ranges changed since the previous one, or a full copy (keyframe).
+struct DeltaMemento {
+    struct Range {
+        std::size_t offset;
+        std::size_t length;
+    };
+
+    bool keyframe = false;
+    int accum = 0;
+    std::vector<Range> ranges;              // keyframe: empty
+    std::vector<unsigned char> bytes;       // keyframe: the whole data, otherwise the ranges back to back
+
+    std::size_t memory() const {
+        return sizeof(DeltaMemento) + ranges.capacity() * sizeof(Range) + bytes.capacity();
+    }
+};
+
+// History of delta mementos. Every m_keyframe_interval entries a full copy is stored, restoring an entry 
+// starts from the keyframe before it and applies the deltas up to it. The data is compared against a 
+// shadow copy of the last pushed state: pages still shared with it are skipped, the others are compared 
+// in blocks of m_block bytes, changed blocks next to each other make one range.
+class DeltaHistory {
+    public:
+        DeltaHistory(std::size_t keyframe_interval = 16, std::size_t block = 64, std::size_t max_entries = MAX_NUM_UNDO)
+            : m_keyframe_interval{keyframe_interval ? keyframe_interval : 1}, m_block{block ? block : 1}, 
+              m_max_entries{max_entries ? max_entries : 1}{}
+
+        void push(const Object &obj) {
+            if(m_entries.size() == m_max_entries)
+                pop_front();
+            DeltaMemento dm;
+            dm.accum = obj.get_accum();
+            if(m_since_keyframe == 0 || m_since_keyframe >= m_keyframe_interval || obj.data_size() != m_shadow.size()){
+                dm.keyframe = true;
+                dm.bytes.resize(obj.data_size());
+                obj.data().read(0, dm.bytes.data(), dm.bytes.size());
+                m_since_keyframe = 1;
+            }
+            else {
+                diff(obj, dm);
+                m_since_keyframe++;
+            }
+            m_shadow = obj.data();
+            m_entries.push_back(std::move(dm));
+        }
+
+        // Rebuild the object state of entry index.
+        void restore(std::size_t index, Object &obj) const {
+            std::size_t key = index;
+            while(!m_entries[key].keyframe)
+                key--;
+            const DeltaMemento &kf = m_entries[key];
+            if(obj.data_size() != kf.bytes.size())
+                obj = Object(0, kf.bytes.size());
+            obj.data().write(0, kf.bytes.data(), kf.bytes.size());
+            for(std::size_t i = key + 1; i <= index; i++)
+                apply(m_entries[i], obj.data());
+            obj.set_accum(m_entries[index].accum);
+        }
+
+        // Drop the newest entry and make the one before it the base of the next delta.
+        void pop_back() {
+            m_entries.pop_back();
+            m_since_keyframe = 0;
+            if(m_entries.empty())
+                return;
+            std::size_t key = m_entries.size() - 1;
+            while(!m_entries[key].keyframe)
+                key--;
+            Object obj(0);
+            restore(m_entries.size() - 1, obj);
+            m_shadow = obj.data();
+            m_since_keyframe = m_entries.size() - key;
+        }
+
+        // Drop the oldest entry, the entry after it becomes a keyframe if it is not one.
+        void pop_front() {
+            if(m_entries.size() > 1 && !m_entries[1].keyframe){
+                std::vector<unsigned char> full = m_entries[0].bytes;
+                apply(m_entries[1], full.data());
+                m_entries[1].keyframe = true;
+                m_entries[1].ranges.clear();
+                m_entries[1].bytes = std::move(full);
+            }
+            m_entries.pop_front();
+            if(m_entries.empty())
+                m_since_keyframe = 0;
+        }
+
+        std::size_t size() const {return m_entries.size();}
+
+        std::size_t memory() const {
+            std::size_t total = 0;
+            for(const DeltaMemento &dm : m_entries)
+                total += dm.memory();
+            return total;
+        }
+
+    private:
+        void diff(const Object &obj, DeltaMemento &dm) {
+            const PagedData &data = obj.data();
+            for(std::size_t p = 0; p < data.num_pages(); p++){
+                if(data.same_page(m_shadow, p))
+                    continue;
+                const unsigned char *cur = data.page(p);
+                const unsigned char *old = m_shadow.page(p);
+                std::size_t size = data.page_size(p);
+                for(std::size_t off = 0; off < size; off += m_block){
+                    std::size_t len = std::min(m_block, size - off);
+                    if(std::memcmp(cur + off, old + off, len) == 0)
+                        continue;
+                    std::size_t pos = p * PAGE_SIZE + off;
+                    if(!dm.ranges.empty() && dm.ranges.back().offset + dm.ranges.back().length == pos)
+                        dm.ranges.back().length += len;
+                    else
+                        dm.ranges.push_back({pos, len});
+                    dm.bytes.insert(dm.bytes.end(), cur + off, cur + off + len);
+                }
+            }
+        }
+
+        static void apply(const DeltaMemento &dm, PagedData &data) {
+            const unsigned char *src = dm.bytes.data();
+            for(const DeltaMemento::Range &r : dm.ranges){
+                data.write(r.offset, src, r.length);
+                src += r.length;
+            }
+        }
+
+        static void apply(const DeltaMemento &dm, unsigned char *data) {
+            const unsigned char *src = dm.bytes.data();
+            for(const DeltaMemento::Range &r : dm.ranges){
+                std::memcpy(data + r.offset, src, r.length);
+                src += r.length;
+            }
+        }
+
+        std::size_t m_keyframe_interval;
+        std::size_t m_block;
+        std::size_t m_max_entries;
+        std::deque<DeltaMemento> m_entries;
+        PagedData m_shadow;                       // data of the newest entry, shares its pages
+        std::size_t m_since_keyframe = 0;         // entries since (and including) the last keyframe
+};
+
+// Append-only history of memento and command records kept in two files, both memory mapped:
+//     <path>.seg   the records back to back: RecordHeader, then data_size bytes of object data
+//     <path>.idx   one 64 bit offset into .seg per record
+// A record is appended to .seg before its offset goes to .idx, so the index never points at a record 
+// that is not fully written. Opening maps the files and takes the record count from the size of the 
+// index, nothing is read or parsed until a record is asked for.
+class HistoryStore {
+    public:
+        HistoryStore() = default;
+        ~HistoryStore() {close();}
+        HistoryStore(const HistoryStore &) = delete;
+        HistoryStore &operator=(const HistoryStore &) = delete;
+
+        // Opens, or creates, the history at path. Returns false when the files can not be opened.
+        bool open(const std::string &path) {
+            close();
+            m_seg_fd = ::open((path + ".seg").c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+            m_idx_fd = ::open((path + ".idx").c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+            if(m_seg_fd < 0 || m_idx_fd < 0){
+                close();
+                return false;
+            }
+            struct stat seg_st, idx_st;
+            if(fstat(m_seg_fd, &seg_st) != 0 || fstat(m_idx_fd, &idx_st) != 0 || !recover(seg_st.st_size, idx_st.st_size)){
+                close();
+                return false;
+            }
+            return remap();
+        }
+
+        void close() {
+            unmap();
+            if(m_seg_fd >= 0)
+                ::close(m_seg_fd);
+            if(m_idx_fd >= 0)
+                ::close(m_idx_fd);
+            m_seg_fd = m_idx_fd = -1;
+            m_seg_size = 0;
+            m_count = 0;
+        }
+
+        // x is the command argument (1 plus one, 2 multiply two), obj the object after the command.
+        // A failed append cuts off what it wrote, so the next record starts where this one would have.
+        bool append(int x, const Object &obj) {
+            RecordHeader hdr{RECORD_MAGIC, x, obj.get_accum(), 0, obj.data_size()};
+            std::uint64_t offset = m_seg_size;
+            if(!write_all(m_seg_fd, &hdr, sizeof(hdr)))
+                return rollback();
+            const PagedData &data = obj.data();
+            for(std::size_t p = 0; p < data.num_pages(); p++)
+                if(!write_all(m_seg_fd, data.page(p), data.page_size(p)))
+                    return rollback();
+            if(!write_all(m_idx_fd, &offset, sizeof(offset)))
+                return rollback();
+            m_seg_size += sizeof(hdr) + obj.data_size();
+            m_count++;
+            return true;
+        }
+
+        std::size_t size() const {return m_count;}
+        // Command argument of record i, 0 when there is no such record or it is damaged.
+        int x(std::size_t i) {
+            const unsigned char *rec = record(i);
+            return rec ? header(rec).x : 0;
+        }
+
+        // Object state of record i, the data is copied straight out of the mapping. Returns false, and
+        // leaves obj alone, when there is no such record or it is damaged.
+        bool load(std::size_t i, Object &obj) {
+            const unsigned char *rec = record(i);
+            if(rec == nullptr)
+                return false;
+            RecordHeader hdr = header(rec);
+            if(obj.data_size() != hdr.data_size)
+                obj = Object(0, hdr.data_size);
+            obj.set_accum(hdr.accum);
+            if(hdr.data_size)
+                obj.data().write(0, rec + sizeof(RecordHeader), hdr.data_size);
+            return true;
+        }
+
+    private:
+        static const std::uint32_t RECORD_MAGIC = 0x4d454d4f;      // "MEMO"
+
+        struct RecordHeader {
+            std::uint32_t magic;
+            std::int32_t x;
+            std::int32_t accum;
+            std::uint32_t reserved;
+            std::uint64_t data_size;
+        };
+
+        static RecordHeader header(const unsigned char *rec) {
+            RecordHeader hdr;
+            std::memcpy(&hdr, rec, sizeof(hdr));
+            return hdr;
+        }
+
+        // Start of record i in the mapping, nullptr when i is out of range or the record does not
+        // lie within the segment file with the right magic.
+        const unsigned char *record(std::size_t i) {
+            if(i >= m_count)
+                return nullptr;
+            if((i + 1) * sizeof(std::uint64_t) > m_idx_mapped && !remap())      // appended after the last mapping
+                return nullptr;
+            std::uint64_t offset = m_idx_map[i];
+            if(offset > m_seg_mapped || m_seg_mapped - offset < sizeof(RecordHeader))
+                return nullptr;
+            RecordHeader hdr = header(m_seg_map + offset);
+            if(hdr.magic != RECORD_MAGIC || m_seg_mapped - offset - sizeof(RecordHeader) < hdr.data_size)
+                return nullptr;
+            return m_seg_map + offset;
+        }
+
+        // Cuts the tail a crash in the middle of append() leaves: offsets are dropped from the back until
+        // one points at a complete record, then .idx is truncated to the remaining offsets and .seg to the
+        // end of that record. Both files are O_APPEND, without this every later record would land after
+        // the torn bytes and its offset after a torn offset.
+        bool recover(std::uint64_t seg_size, std::uint64_t idx_size) {
+            m_count = idx_size / sizeof(std::uint64_t);
+            m_seg_size = 0;
+            while(m_count > 0){
+                std::uint64_t offset;
+                RecordHeader hdr;
+                if(::pread(m_idx_fd, &offset, sizeof(offset), (m_count - 1) * sizeof(offset)) == static_cast<ssize_t>(sizeof(offset))
+                   && offset <= seg_size && seg_size - offset >= sizeof(hdr)
+                   && ::pread(m_seg_fd, &hdr, sizeof(hdr), offset) == static_cast<ssize_t>(sizeof(hdr))
+                   && hdr.magic == RECORD_MAGIC && seg_size - offset - sizeof(hdr) >= hdr.data_size){
+                    m_seg_size = offset + sizeof(hdr) + hdr.data_size;
+                    break;
+                }
+                m_count--;
+            }
+            if(idx_size != m_count * sizeof(std::uint64_t) && ::ftruncate(m_idx_fd, m_count * sizeof(std::uint64_t)) != 0)
+                return false;
+            return seg_size == m_seg_size || ::ftruncate(m_seg_fd, m_seg_size) == 0;
+        }
+
+        // Truncates both files back to the records appended so far. When that fails too the store is closed,
+        // the next open() cuts the torn tail. Always returns false, the append failed.
+        bool rollback() {
+            if(::ftruncate(m_seg_fd, m_seg_size) != 0 || ::ftruncate(m_idx_fd, m_count * sizeof(std::uint64_t)) != 0)
+                close();
+            return false;
+        }
+
+        bool remap() {
+            unmap();
+            m_seg_mapped = m_seg_size;
+            m_idx_mapped = m_count * sizeof(std::uint64_t);
+            if(m_seg_mapped){
+                void *p = mmap(nullptr, m_seg_mapped, PROT_READ, MAP_SHARED, m_seg_fd, 0);
+                if(p == MAP_FAILED){
+                    m_seg_mapped = m_idx_mapped = 0;
+                    return false;
+                }
+                m_seg_map = static_cast<const unsigned char *>(p);
+            }
+            if(m_idx_mapped){
+                void *p = mmap(nullptr, m_idx_mapped, PROT_READ, MAP_SHARED, m_idx_fd, 0);
+                if(p == MAP_FAILED){
+                    m_idx_mapped = 0;
+                    return false;
+                }
+                m_idx_map = static_cast<const std::uint64_t *>(p);
+            }
+            return true;
+        }
+
+        void unmap() {
+            if(m_seg_map)
+                munmap(const_cast<unsigned char *>(m_seg_map), m_seg_mapped);
+            if(m_idx_map)
+                munmap(const_cast<std::uint64_t *>(m_idx_map), m_idx_mapped);
+            m_seg_map = nullptr;
+            m_idx_map = nullptr;
+            m_seg_mapped = m_idx_mapped = 0;
+        }
+
+        static bool write_all(int fd, const void *buf, std::size_t len) {
+            const char *p = static_cast<const char *>(buf);
+            while(len){
+                ssize_t n = ::write(fd, p, len);
+                if(n <= 0)
+                    return false;
+                p += n;
+                len -= n;
+            }
+            return true;
+        }
+
+        int m_seg_fd = -1;
+        int m_idx_fd = -1;
+        const unsigned char *m_seg_map = nullptr;
+        const std::uint64_t *m_idx_map = nullptr;
+        std::size_t m_seg_mapped = 0;
+        std::size_t m_idx_mapped = 0;
+        std::uint64_t m_seg_size = 0;
+        std::size_t m_count = 0;
+};
+
+// Small LZ77 codec in the LZ4 block layout: a token byte (literal count in the high nibble, match length - 4
+// in the low one, 15 means more length bytes follow), the literals, a 16 bit little endian offset, the 
+// extra match length bytes. The last sequence has literals only.
+namespace lz {
+    const std::size_t MIN_MATCH = 4;
+    const int HASH_BITS = 12;
+
+    inline std::uint32_t read32(const unsigned char *p) {
+        std::uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline void put_length(std::vector<unsigned char> &out, std::size_t len) {
+        while(len >= 255){
+            out.push_back(255);
+            len -= 255;
+        }
+        out.push_back(static_cast<unsigned char>(len));
+    }
+
+    // Appends the compressed form of src to out.
+    inline void compress(const unsigned char *src, std::size_t size, std::vector<unsigned char> &out) {
+        std::uint32_t table[1 << HASH_BITS] = {};        // position + 1 of the last 4 bytes with this hash
+        std::size_t anchor = 0;                          // first literal not written yet
+        std::size_t pos = 0;
+        const std::size_t limit = size > 12 ? size - 12 : 0;    // leave the tail as literals
+
+        while(pos < limit){
+            std::uint32_t seq = read32(src + pos);
+            std::uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+            std::size_t cand = table[h];
+            table[h] = static_cast<std::uint32_t>(pos + 1);
+            if(cand == 0 || pos - (cand - 1) > 0xffff || read32(src + cand - 1) != seq){
+                pos++;
+                continue;
+            }
+            std::size_t ref = cand - 1;
+            std::size_t len = MIN_MATCH;
+            while(pos + len < size - 5 && src[ref + len] == src[pos + len])
+                len++;
+
+            std::size_t lit = pos - anchor;
+            std::size_t ml = len - MIN_MATCH;
+            out.push_back(static_cast<unsigned char>((lit < 15 ? lit : 15) << 4 | (ml < 15 ? ml : 15)));
+            if(lit >= 15)
+                put_length(out, lit - 15);
+            out.insert(out.end(), src + anchor, src + pos);
+            std::size_t offset = pos - ref;
+            out.push_back(static_cast<unsigned char>(offset & 0xff));
+            out.push_back(static_cast<unsigned char>(offset >> 8));
+            if(ml >= 15)
+                put_length(out, ml - 15);
+            pos += len;
+            anchor = pos;
+        }
+
+        std::size_t lit = size - anchor;
+        out.push_back(static_cast<unsigned char>((lit < 15 ? lit : 15) << 4));
+        if(lit >= 15)
+            put_length(out, lit - 15);
+        out.insert(out.end(), src + anchor, src + size);
+    }
+
+    // Returns false when src is not a valid stream decoding to exactly size bytes.
+    inline bool decompress(const unsigned char *src, std::size_t src_size, unsigned char *dst, std::size_t size) {
+        const unsigned char *in = src;
+        const unsigned char *in_end = src + src_size;
+        std::size_t out = 0;
+        while(in < in_end){
+            unsigned char token = *in++;
+            std::size_t lit = token >> 4;
+            if(lit == 15)
+                for(unsigned char b = 255; b == 255 && in < in_end; lit += b)
+                    b = *in++;
+            if(lit > static_cast<std::size_t>(in_end - in) || lit > size - out)
+                return false;
+            if(lit)
+                std::memcpy(dst + out, in, lit);
+            in += lit;
+            out += lit;
+            if(in == in_end)
+                break;                                   // last sequence
+            if(in_end - in < 2)
+                return false;
+            std::size_t offset = in[0] | (in[1] << 8);
+            in += 2;
+            std::size_t len = (token & 0x0f);
+            if(len == 15)
+                for(unsigned char b = 255; b == 255 && in < in_end; len += b)
+                    b = *in++;
+            len += MIN_MATCH;
+            if(offset == 0 || offset > out || len > size - out)
+                return false;
+            for(std::size_t i = 0; i < len; i++, out++)      // may overlap itself
+                dst[out] = dst[out - offset];
+        }
+        return out == size;
+    }
+}
+
+// Undo history with a hot and a cold tier. The newest m_hot entries are plain Mementos. A background 
+// thread moves older entries to the cold tier: only the pages that differ from the next newer entry are 
+// kept, LZ compressed, so a cold entry is a compressed reverse delta. Undoing into the cold tier 
+// decompresses one entry onto the state after it and makes it hot again.
+//
+// As with SnapshotChannel, the writer decides whether a page is still shared from its use count, which 
+// carries no ordering. The compressor never drops a copy of a page itself: the copies it read and the hot 
+// memento it replaced go back under the mutex, and the next push() or pop() drops them on the writer's 
+// thread, so the compressor's reads happen before the writer's next write to those pages.
+class TieredHistory {
+    public:
+        TieredHistory(std::size_t hot = 16, std::size_t max_entries = MAX_NUM_UNDO)
+            : m_hot{hot ? hot : 1}, m_max_entries{max_entries ? max_entries : 1},
+              m_worker{&TieredHistory::compressor, this}{}
+
+        ~TieredHistory() {
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                m_stop = true;
+            }
+            m_cv.notify_one();
+            m_worker.join();
+        }
+
+        void push(const Object &obj) {
+            std::vector<Object> returned;
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                returned.swap(m_returned);                  // destroyed below, on the writer thread
+                if(m_entries.size() == m_max_entries)
+                    m_entries.pop_front();
+                Entry entry;
+                entry.id = m_next_id++;
+                entry.hot = Memento(obj);
+                entry.accum = obj.get_accum();
+                m_entries.push_back(std::move(entry));
+            }
+            m_cv.notify_one();
+        }
+
+        // Undo: drops the newest entry, obj gets the state of the one before it. False when there is none,
+        // or when that entry is cold and its blob does not decompress; the history is left as it was.
+        bool pop(Object &obj) {
+            std::vector<Object> returned;
+            std::unique_lock<std::mutex> lock(m_mtx);
+            returned.swap(m_returned);
+            if(m_entries.size() < 2)
+                return false;
+            Entry newest = std::move(m_entries.back());
+            m_entries.pop_back();
+            Entry &entry = m_entries.back();
+            if(entry.cold){
+                Entry cold = std::move(entry);
+                lock.unlock();                          // decompress without blocking the compressor
+                Object restored = newest.hot.m_object;
+                bool thawed = thaw(cold, restored);
+                lock.lock();
+                if(!thawed){
+                    m_entries.back() = std::move(cold);
+                    m_entries.push_back(std::move(newest));
+                    return false;
+                }
+                Entry &back = m_entries.back();
+                back.cold = false;
+                back.hot = Memento(restored);
+                back.pages.clear();
+                back.blob.clear();
+                m_deep_undos++;
+            }
+            obj = m_entries.back().hot.m_object;
+            return true;
+        }
+
+        std::size_t size() {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            return m_entries.size();
+        }
+
+        struct Stats {
+            std::size_t cold_entries;
+            std::size_t raw_bytes;              // changed page bytes of the cold entries
+            std::size_t compressed_bytes;
+            double compress_cpu_s;              // CPU time of the compressor thread
+            std::size_t deep_undos;             // undos that had to decompress
+        };
+
+        Stats stats() {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            Stats st{0, 0, 0, m_compress_cpu_s, m_deep_undos};
+            for(const Entry &entry : m_entries)
+                if(entry.cold){
+                    st.cold_entries++;
+                    st.raw_bytes += entry.raw_size;
+                    st.compressed_bytes += entry.blob.size();
+                }
+            return st;
+        }
+
+        // Blocks until every entry outside the hot tier has been compressed.
+        void wait_idle() {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_idle_cv.wait(lock, [this]{ return next_to_compress() == m_entries.size() && !m_busy; });
+        }
+
+    private:
+        struct Entry {
+            std::uint64_t id = 0;                   // counts pushes, increases from front to back
+            bool cold = false;
+            int accum = 0;
+            Memento hot;                            // hot entry
+            std::size_t data_size = 0;              // cold entry, the pages differing from the next entry:
+            std::vector<std::uint32_t> pages;
+            std::vector<unsigned char> blob;        //   compressed back to back
+            std::size_t raw_size = 0;
+        };
+
+        // Index of the oldest entry outside the hot tier that is still hot, or size() when there is none.
+        std::size_t next_to_compress() const {
+            std::size_t end = m_entries.size() > m_hot ? m_entries.size() - m_hot : 0;
+            for(std::size_t i = 0; i < end; i++)
+                if(!m_entries[i].cold)
+                    return i;
+            return m_entries.size();
+        }
+
+        std::size_t find(std::uint64_t id) const {
+            std::size_t lo = 0, hi = m_entries.size();
+            while(lo < hi){
+                std::size_t mid = (lo + hi) / 2;
+                if(m_entries[mid].id < id)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            return lo;
+        }
+
+        static Entry freeze(const Object &obj, const Object &newer) {
+            Entry entry;
+            entry.cold = true;
+            entry.accum = obj.get_accum();
+            const PagedData &data = obj.data();
+            const PagedData &next = newer.data();
+            entry.data_size = data.size();
+            std::vector<unsigned char> raw;
+            for(std::size_t p = 0; p < data.num_pages(); p++){
+                if(next.size() == data.size() && (data.same_page(next, p) || 
+                   std::memcmp(data.page(p), next.page(p), data.page_size(p)) == 0))
+                    continue;
+                entry.pages.push_back(static_cast<std::uint32_t>(p));
+                raw.insert(raw.end(), data.page(p), data.page(p) + data.page_size(p));
+            }
+            entry.raw_size = raw.size();
+            lz::compress(raw.data(), raw.size(), entry.blob);
+            return entry;
+        }
+
+        // Applies a cold entry to obj, the state after it. Returns false, with obj unchanged, when the blob
+        // does not decompress to exactly raw_size bytes or the pages do not add up to it.
+        static bool thaw(const Entry &entry, Object &obj) {
+            std::vector<unsigned char> raw(entry.raw_size);
+            if(!lz::decompress(entry.blob.data(), entry.blob.size(), raw.data(), raw.size()))
+                return false;
+            Object restored = obj.data_size() == entry.data_size ? obj : Object(0, entry.data_size);
+            std::size_t used = 0;
+            for(std::uint32_t p : entry.pages){
+                if(p >= restored.data().num_pages())
+                    return false;
+                std::size_t len = restored.data().page_size(p);
+                if(len > raw.size() - used)
+                    return false;
+                restored.data().write(static_cast<std::size_t>(p) * PAGE_SIZE, raw.data() + used, len);
+                used += len;
+            }
+            if(used != raw.size())
+                return false;
+            restored.set_accum(entry.accum);
+            obj = std::move(restored);
+            return true;
+        }
+
+        void compressor() {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            while(true){
+                std::size_t i = next_to_compress();
+                if(i == m_entries.size()){
+                    m_idle_cv.notify_all();
+                    m_cv.wait(lock);
+                    if(m_stop)
+                        return;
+                    continue;
+                }
+                std::uint64_t id = m_entries[i].id;
+                std::uint64_t newer_id = m_entries[i + 1].id;
+                Object obj = m_entries[i].hot.m_object;          // O(1) copies, the pages are shared
+                Object newer = m_entries[i + 1].cold ? Object(0) : m_entries[i + 1].hot.m_object;
+                m_busy = true;
+                lock.unlock();
+
+                timespec t0, t1;
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+                Entry cold = freeze(obj, newer);
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+
+                lock.lock();
+                m_busy = false;
+                m_compress_cpu_s += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+                // Meanwhile the entry may have been evicted, or the one after it undone and replaced.
+                std::size_t at = find(id);
+                if(at + 1 < m_entries.size() && m_entries[at].id == id && m_entries[at + 1].id == newer_id && !m_entries[at].cold){
+                    cold.id = id;
+                    m_returned.push_back(std::move(m_entries[at].hot.m_object));
+                    m_entries[at] = std::move(cold);
+                }
+                m_returned.push_back(std::move(obj));
+                m_returned.push_back(std::move(newer));
+                if(m_stop)
+                    return;
+            }
+        }
+
+        std::size_t m_hot;
+        std::size_t m_max_entries;
+        std::mutex m_mtx;
+        std::condition_variable m_cv;               // wakes the compressor
+        std::condition_variable m_idle_cv;          // compressor has nothing to do
+        std::deque<Entry> m_entries;                // oldest first
+        std::vector<Object> m_returned;             // the compressor's copies, the writer drops them
+        std::uint64_t m_next_id = 0;
+        bool m_busy = false;                        // compressor works on an entry
+        double m_compress_cpu_s = 0;
+        std::size_t m_deep_undos = 0;
+        bool m_stop = false;
+        std::thread m_worker;                       // last, starts once the rest is set up
+};
+
+// Lets other threads take consistent mementos of an object that one writer thread keeps changing. The 
+// writer calls checkpoint() between commands. A thread that wants a snapshot raises a flag and waits for 
+// the next checkpoint, where the writer copies the Object, which is O(1) since the copy shares the pages. 
+// The writer then carries on, its next write to a shared page copies that page, so the snapshot stays 
+// as it was while the taker does whatever it wants with it (store, compress, ...) on its own thread.
+//
+// The writer decides whether a page is still shared from its use count, which carries no ordering. So a 
+// snapshot, and every copy made of it, must not be destroyed on another thread: it comes back through 
+// give_back() or the next take(), and the writer drops it at its next checkpoint under the channel's 
+// mutex. The taker's reads then happen before the writer's next write to those pages.
+class SnapshotChannel {
+    public:
+        SnapshotChannel(const Object *obj) : m_object{obj}{}
+
+        // Writer thread only. One atomic load when nobody is waiting for a snapshot or handing one back.
+        void checkpoint() {
+            if(m_pending.load(std::memory_order_acquire))
+                service();
+        }
+
+        // Writer thread, no more checkpoints will come.
+        void close() {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_closed = true;
+            m_cv.notify_all();
+        }
+
+        // Any other thread. Waits for the writer's next checkpoint, false once the channel is closed. 
+        // Whatever mem held before, an earlier snapshot, is handed back first.
+        bool take(Memento &mem) {
+            std::lock_guard<std::mutex> one_at_a_time(m_take_mtx);
+            std::unique_lock<std::mutex> lock(m_mtx);
+            hand_back(mem);
+            if(m_closed)
+                return false;
+            m_ready = false;
+            m_pending.fetch_or(SNAPSHOT_REQUESTED, std::memory_order_release);
+            m_cv.wait(lock, [this]{ return m_ready || m_closed; });
+            if(!m_ready)
+                return false;
+            mem = std::move(m_snapshot);
+            m_snapshot = Memento();
+            return true;
+        }
+
+        // Any other thread. Returns a snapshot, or a copy of one, that is no longer needed.
+        void give_back(Memento &mem) {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            hand_back(mem);
+        }
+
+    private:
+        static const unsigned SNAPSHOT_REQUESTED = 1;
+        static const unsigned SNAPSHOT_RETURNED = 2;
+
+        void hand_back(Memento &mem) {              // m_mtx held
+            if(mem.m_object.data().num_pages() == 0)
+                return;                             // nothing shared, an empty memento
+            m_returned.push_back(std::move(mem));
+            mem = Memento();
+            m_pending.fetch_or(SNAPSHOT_RETURNED, std::memory_order_release);
+        }
+
+        void service() {
+            std::vector<Memento> returned;
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                returned.swap(m_returned);           // destroyed below, on the writer thread
+                if(m_pending.load(std::memory_order_relaxed) & SNAPSHOT_REQUESTED){
+                    m_object->saveMemento(m_snapshot);
+                    m_ready = true;
+                    m_cv.notify_all();
+                }
+                m_pending.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        const Object *m_object;
+        std::atomic<unsigned> m_pending{0};         // SNAPSHOT_ flags
+        std::mutex m_take_mtx;
+        std::mutex m_mtx;
+        std::condition_variable m_cv;
+        Memento m_snapshot;
+        std::vector<Memento> m_returned;            // handed back, the writer drops them
+        bool m_ready = false;
+        bool m_closed = false;
+};
+
+typedef std::function<void(Object*, int)>  Mfuncp;
+
+enum UndoMode {
+    UNDO_INVERSE,       // undo recomputes the accumulator from the command (-1, /2), redo repeats the last command
+    UNDO_SNAPSHOT       // undo restores the memento before the command, redo restores the undone memento
+};
+
+enum UndoGranularity {
+    UNDO_EVERY_COMMAND, // one history entry per command
+    UNDO_COALESCE       // repeats of the same command within the time window share one entry (+1 x k is one +k)
+};
+
+// What a Command records itself into.
+class UndoHistoryBase {
+    public:
+        virtual ~UndoHistoryBase() = default;
+        // Record a command that has just been applied to the object.
+        virtual void push(const Mfuncp &action, int x) = 0;
+        virtual void undo() = 0;
+        virtual void redo() = 0;
+        virtual Object *object() const = 0;
+        virtual bool verbose() const = 0;
+};
+
+// The undo history of one Object (document). Every document has its own manager, nothing is shared between 
+// managers, so documents can be edited on different threads without locking. A manager itself is not 
+// thread safe, one document is edited by one thread at a time.
+// In UNDO_SNAPSHOT mode undo and redo assign a memento to the object, which is O(1) however large the 
+// object is and whatever the command did, because Object copies share their data pages.
+class UndoManager : public UndoHistoryBase {
+    public:
+        UndoManager(Object *obj, std::size_t max_undo = MAX_NUM_UNDO, UndoMode mode = UNDO_SNAPSHOT)
+            : m_object{obj}, m_mode{mode}, m_base{*obj}, m_mementoList(max_undo), m_commandList(max_undo), 
+              m_redoMementoList(max_undo), m_redoCommandList(max_undo){}
+
+        // Drops whatever could be redone.
+        void push(const Mfuncp &action, int x) override;
+        void redo() override;
+        void undo() override;
+
+        Object *object() const override {return m_object;}
+        std::size_t size() const {return m_commandList.size();}
+        bool verbose() const override {return m_verbose;}
+        void set_verbose(bool verbose) {m_verbose = verbose;}
+        // Every executed and redone command is also appended to the store, undo does not rewrite it.
+        void set_store(HistoryStore *store) {m_store = store;}
+        // With UNDO_COALESCE a command joins the newest entry when it is the same action with the same 
+        // argument, executed at most window after the previous one. One undo then takes back the whole run.
+        void set_granularity(UndoGranularity granularity, 
+                             std::chrono::milliseconds window = std::chrono::milliseconds(500)) {
+            m_granularity = granularity;
+            m_window = window;
+        }
+
+    private:
+        // What the history keeps of an executed command, stored inline in the ring.
+        struct Record {
+            Mfuncp m_action;
+            int m_x = 0;
+            int m_count = 1;                                    // commands coalesced into this entry
+            std::chrono::steady_clock::time_point m_time;       // of the last of them
+        };
+
+        typedef void (Object::*MemberAction)(int);
+
+        static bool same_action(const Mfuncp &a, const Mfuncp &b) {
+            const MemberAction *pa = a.target<MemberAction>();
+            const MemberAction *pb = b.target<MemberAction>();
+            return pa && pb && *pa == *pb;                      // lambdas and the like never coalesce
+        }
+
+        bool coalesce(const Mfuncp &action, int x);
+        void record(const Mfuncp &action, int x);
+        void redo_snapshot();
+        void undo_snapshot();
+
+        Object *m_object;
+        UndoMode m_mode;
+        UndoGranularity m_granularity = UNDO_EVERY_COMMAND;
+        std::chrono::milliseconds m_window{500};
+        bool m_verbose = true;
+        HistoryStore *m_store = nullptr;
+        Memento m_base;                          // the state before the oldest entry
+        RingBuffer<Memento> m_mementoList;       // only keep max_undo, older are overwritten
+        RingBuffer<Record> m_commandList;
+        RingBuffer<Memento> m_redoMementoList;   // undone entries, newest undone at the back
+        RingBuffer<Record> m_redoCommandList;
+};
+
+// Undo history that keeps every branch. Each node holds the memento of the state after its command, 
+// and since mementos share the pages and table nodes they did not change, a node costs about the pages 
+// its command wrote. Undo goes to the parent, redo to the child visited last, go_to() jumps to any node.
+class UndoTree : public UndoHistoryBase {
+    public:
+        UndoTree(Object *obj) : m_object{obj} {
+            m_nodes.push_back(Node{-1, 0, 0, Memento(*obj), {}, -1});       // root, the state to start from
+        }
+
+        // A new child of the current node, the branches already there are kept.
+        void push(const Mfuncp &, int x) override {
+            int id = static_cast<int>(m_nodes.size());
+            m_nodes.push_back(Node{m_current, m_nodes[m_current].depth + 1, x, Memento(*m_object), {}, -1});
+            m_nodes[m_current].children.push_back(id);
+            m_nodes[m_current].redo_child = id;
+            m_current = id;
+        }
+
+        void undo() override {
+            if(m_current == 0){
+                if(m_verbose)
+                    std::cout << "Can not execute undo, no command has be execute!"  << '\n';
+                return;
+            }
+            m_nodes[m_nodes[m_current].parent].redo_child = m_current;
+            m_current = m_nodes[m_current].parent;
+            restore("Undo");
+        }
+
+        void redo() override {
+            int child = m_nodes[m_current].redo_child;
+            if(child < 0){
+                if(m_verbose)
+                    std::cout << "Nothing to redo! \n";
+                return;
+            }
+            m_current = child;
+            restore("Redo");
+        }
+
+        // Jump to any node. Restoring the state is O(1), pointing the redo children along the way back to 
+        // the common ancestor is O(depth), so redo keeps following the branch that was jumped to.
+        void go_to(int node) {
+            if(node < 0 || node >= static_cast<int>(m_nodes.size())){
+                std::cout << "No node " << node << "!\n";
+                return;
+            }
+            int top = common_ancestor(m_current, node);
+            for(int n = node; n != top; n = m_nodes[n].parent)
+                m_nodes[m_nodes[n].parent].redo_child = n;
+            m_current = node;
+            restore("Go to");
+        }
+
+        // Nodes to pass through from one node to another, O(depth): up to the common ancestor, then down.
+        std::vector<int> path(int from, int to) const {
+            int top = common_ancestor(from, to);
+            std::vector<int> up, down;
+            for(int n = from; n != top; n = m_nodes[n].parent)
+                up.push_back(n);
+            up.push_back(top);
+            for(int n = to; n != top; n = m_nodes[n].parent)
+                down.push_back(n);
+            up.insert(up.end(), down.rbegin(), down.rend());
+            return up;
+        }
+
+        int current() const {return m_current;}
+        std::size_t size() const {return m_nodes.size();}
+        const std::vector<int> &children(int node) const {return m_nodes[node].children;}
+        const Object &state(int node) const {return m_nodes[node].state.m_object;}
+        Object *object() const override {return m_object;}
+        bool verbose() const override {return m_verbose;}
+        void set_verbose(bool verbose) {m_verbose = verbose;}
+
+    private:
+        struct Node {
+            int parent;
+            int depth;
+            int x;                          // argument of the command that led here
+            Memento state;                  // the state after that command
+            std::vector<int> children;
+            int redo_child;                 // child that redo goes to, -1 none
+        };
+
+        int common_ancestor(int a, int b) const {
+            while(m_nodes[a].depth > m_nodes[b].depth)
+                a = m_nodes[a].parent;
+            while(m_nodes[b].depth > m_nodes[a].depth)
+                b = m_nodes[b].parent;
+            while(a != b){
+                a = m_nodes[a].parent;
+                b = m_nodes[b].parent;
+            }
+            return a;
+        }
+
+        void restore(const char *what) {
+            *m_object = m_nodes[m_current].state.m_object;
+            if(m_verbose)
+                std::cout << '\n' << what << "() is executed, now at node " << m_current << ", m_accum = " 
+                          << m_object->get_accum() << '\n' << '\n';
+        }
+
+        Object *m_object;
+        bool m_verbose = true;
+        std::vector<Node> m_nodes;          // node 0 is the root
+        int m_current = 0;
+};
+
+// History that keeps a checkpoint (memento) every m_interval commands and only logs the commands, action 
+// and argument, in between. Any point is restored by loading the checkpoint at or before it and replaying 
+// the logged commands up to it, so the commands have to be deterministic. A longer interval keeps fewer 
+// checkpoints and replays more commands per restore. At least max_undo commands stay undoable, older ones 
+// are dropped together with the oldest checkpoint, a whole interval at a time.
+class CheckpointHistory : public UndoHistoryBase {
+    public:
+        CheckpointHistory(Object *obj, std::size_t interval = 16, std::size_t max_undo = MAX_NUM_UNDO)
+            : m_object{obj}, m_interval{interval ? interval : 1}, m_max_undo{max_undo} {
+            m_checkpoints.push_back(Memento(*obj));
+        }
+
+        // Drops the commands after the current point, then logs this one.
+        void push(const Mfuncp &action, int x) override {
+            m_log.resize(m_position);
+            m_checkpoints.resize(m_position / m_interval + 1);
+            m_log.push_back(LogEntry{action, x});
+            m_position++;
+            if(m_position % m_interval == 0)
+                m_checkpoints.push_back(Memento(*m_object));
+            while(m_position >= m_max_undo + m_interval && m_checkpoints.size() > 1){
+                m_checkpoints.pop_front();                  // the next one becomes the oldest point
+                m_log.erase(m_log.begin(), m_log.begin() + m_interval);
+                m_position -= m_interval;
+            }
+        }
+
+        void undo() override {
+            if(m_position == 0){
+                if(m_verbose)
+                    std::cout << "Can not execute undo, no command has be execute!"  << '\n';
+                return;
+            }
+            restore(m_position - 1, *m_object);
+            m_position--;
+            if(m_verbose)
+                std::cout << "\nUndo() is executed, now m_accum = " << m_object->get_accum() << '\n' << '\n';
+        }
+
+        // Replays the next logged command.
+        void redo() override {
+            if(m_position == m_log.size()){
+                if(m_verbose)
+                    std::cout << "Nothing to redo! \n";
+                return;
+            }
+            m_log[m_position].m_action(m_object, m_log[m_position].m_x);
+            m_position++;
+            if(m_verbose)
+                std::cout << "\nRedo() is executed, now m_accum = " << m_object->get_accum() << '\n' << '\n';
+        }
+
+        // The state after the first point commands kept, point 0 is the oldest checkpoint.
+        void restore(std::size_t point, Object &obj) const {
+            std::size_t cp = std::min(point / m_interval, m_checkpoints.size() - 1);
+            obj = m_checkpoints[cp].m_object;
+            for(std::size_t i = cp * m_interval; i < point; i++)
+                m_log[i].m_action(&obj, m_log[i].m_x);
+        }
+
+        std::size_t size() const {return m_log.size();}
+        std::size_t position() const {return m_position;}
+        std::size_t checkpoints() const {return m_checkpoints.size();}
+        const Object &checkpoint(std::size_t i) const {return m_checkpoints[i].m_object;}
+        Object *object() const override {return m_object;}
+        bool verbose() const override {return m_verbose;}
+        void set_verbose(bool verbose) {m_verbose = verbose;}
+
+    private:
+        struct LogEntry {
+            Mfuncp m_action;
+            int m_x;
+        };
+
+        Object *m_object;
+        std::size_t m_interval;
+        std::size_t m_max_undo;
+        bool m_verbose = true;
+        std::deque<Memento> m_checkpoints;      // m_checkpoints[i] is the state after i * m_interval commands
+        std::deque<LogEntry> m_log;             // both counted from the oldest checkpoint kept
+        std::size_t m_position = 0;             // commands applied to the object since that checkpoint
+};
+
 class Command {
-    typedef std::function<void(Object*, int)>  Mfuncp;
     public:
-        Command(Object *obj, Mfuncp funcp)
-            : m_object{obj}, m_action{funcp}{}
-        Command(Object *obj, Mfuncp funcp, int x)           
-            : m_object{obj}, m_action{funcp}, m_x{x}{}
+        Command(UndoHistoryBase *mgr, Mfuncp funcp)
+            : m_manager{mgr}, m_action{funcp}{}
+        Command(UndoHistoryBase *mgr, Mfuncp funcp, int x)           
+            : m_manager{mgr}, m_action{funcp}, m_x{x}{}
       
         void execute(int);
-        static void redo();
-        static void undo();
         
     private:
-        Object *m_object;
+        UndoHistoryBase *m_manager;
         Mfuncp m_action;
         int m_x;
-        static int m_index;
-        static std::list<std::unique_ptr<Memento>> m_mementoList;       
-        static std::list<std::unique_ptr<Command>> m_commandList;
 };
 
-int Command::m_index;
-std::list<std::unique_ptr<Memento>> Command::m_mementoList;
-std::list<std::unique_ptr<Command>> Command::m_commandList;
+void UndoManager::push(const Mfuncp &action, int x) {
+    m_redoMementoList.clear();
+    m_redoCommandList.clear();
+    if(!coalesce(action, x))
+        record(action, x);
+}
+
+// Fold the command into the newest entry when the granularity policy allows it.
+bool UndoManager::coalesce(const Mfuncp &action, int x) {
+    if(m_granularity != UNDO_COALESCE || m_commandList.empty())
+        return false;
+    Record &rec = m_commandList.back();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if(rec.m_x != x || now - rec.m_time > m_window || !same_action(rec.m_action, action))
+        return false;
+    m_object->saveMemento(m_mementoList.back());
+    rec.m_count++;
+    rec.m_time = now;
+    if(m_store && !m_store->append(x, *m_object))
+        std::cout << "Failed to write the history file!\n";
+    return true;
+}
+
+void UndoManager::record(const Mfuncp &action, int x) {
+    if(m_mementoList.full())
+        m_base = m_mementoList.front();      // about to be overwritten
+    m_object->saveMemento(m_mementoList.push_back());
+    Record &rec = m_commandList.push_back();
+    rec.m_action = action;
+    rec.m_x = x;
+    rec.m_count = 1;
+    rec.m_time = std::chrono::steady_clock::now();
+    if(m_store && !m_store->append(x, *m_object))
+        std::cout << "Failed to write the history file!\n";
+}
 
 void Command::execute(int i) { 
-    if(m_index + 1 > MAX_NUM_UNDO){   // only keep MAX_NUM_UNDO, older will be overwrite 
-        m_mementoList.pop_front();
-        m_commandList.pop_front();
-        m_index--;
-    }
+    Object *obj = m_manager->object();
     m_x = i;
-    m_action(m_object, i);
-    std::unique_ptr<Memento> ump = m_object->createMemento();
-    m_mementoList.push_back(std::move(ump));
-    std::unique_ptr<Command> cmdp = std::make_unique<Command>(*this);
+    m_action(obj, i);
+    m_manager->push(m_action, m_x);
+    if(!m_manager->verbose())
+        return;
     if(i == 1)
-        std::cout << "\naccumulater add one, m_accum = " << cmdp->m_object->get_accum() << '\n' << '\n';
+        std::cout << "\naccumulater add one, m_accum = " << obj->get_accum() << '\n' << '\n';
     else
-        std::cout << "\naccumulator multiply two, m_accum = " << cmdp->m_object->get_accum() << '\n' << '\n';
-    m_commandList.push_back(std::move(cmdp));  
-    m_index++;
+        std::cout << "\naccumulator multiply two, m_accum = " << obj->get_accum() << '\n' << '\n';
 }
 
-void Command::redo(){ 
-    if(m_index == 0){
-        std::cout << "No command has been excuted! \n";
+void UndoManager::redo_snapshot(){
+    if(m_redoCommandList.empty()){
+        if(m_verbose)
+            std::cout << "Nothing to redo! \n";
+        return;
+    }
+    *m_object = m_redoMementoList.back().m_object;
+    Record rec = m_redoCommandList.back();
+    m_redoMementoList.pop_back();
+    m_redoCommandList.pop_back();
+    record(rec.m_action, rec.m_x);
+    if(m_verbose)
+        std::cout << "\nRedo() is executed, now m_accum = " << m_object->get_accum() << '\n' << '\n'; 
+}
+
+void UndoManager::undo_snapshot(){
+    if(m_commandList.empty()){
+        if(m_verbose)
+            std::cout << "Can not execute undo, no command has be execute!"  << '\n';
+        return;
+    }
+    m_redoMementoList.push_back(m_mementoList.back());
+    m_redoCommandList.push_back(m_commandList.back());
+    m_mementoList.pop_back();
+    m_commandList.pop_back();
+    *m_object = m_mementoList.empty() ? m_base.m_object : m_mementoList.back().m_object;
+    if(m_verbose)
+        std::cout << "\nUndo() is executed, now m_accum = " << m_object->get_accum() << '\n' << '\n'; 
+}
+
+void UndoManager::redo(){ 
+    if(m_mode == UNDO_SNAPSHOT){
+        redo_snapshot();
         return;
     }
-    if(m_index + 1 > MAX_NUM_UNDO){
-        m_mementoList.pop_front();
-        m_commandList.pop_front();
-        m_index--;
+    if(m_commandList.empty()){
+        std::cout << "No command has been excuted! \n";
+        return;
     }
     
-    Command *cmdp = m_commandList.back().get(); 
-    cmdp->m_action(cmdp->m_object, cmdp->m_x); 
-    std::cout << "\nRedo() is executed, now m_accum = " << cmdp->m_object->get_accum() << '\n' << '\n'; 
-    std::unique_ptr<Memento> ummtp = cmdp->m_object->createMemento();
-    m_mementoList.push_back(std::move(ummtp));
-    std::unique_ptr<Command> ucmdp = std::make_unique<Command>(cmdp->m_object, cmdp->m_action, cmdp->m_x); 
-    m_commandList.push_back(std::move(ucmdp));
-    m_index++;    
+    Record rec = m_commandList.back(); 
+    rec.m_action(m_object, rec.m_x); 
+    if(m_verbose)
+        std::cout << "\nRedo() is executed, now m_accum = " << m_object->get_accum() << '\n' << '\n'; 
+    record(rec.m_action, rec.m_x);
 }
    
 
-void Command::undo(){ 
-    if(m_index == 1){
-        auto  tmp = m_commandList.end();  // can use .back().get() 
-        Command *cmd = (*--tmp).get();
-        cmd->m_object->set_accum(0); 
-        std::cout << "\nUndo() is executed, now m_accum = " << cmd->m_object->get_accum() << '\n' << '\n'; 
+void UndoManager::undo(){ 
+    if(m_mode == UNDO_SNAPSHOT){
+        undo_snapshot();
+        return;
+    }
+    if(m_commandList.size() == 1){
+        m_object->set_accum(0); 
+        if(m_verbose)
+            std::cout << "\nUndo() is executed, now m_accum = " << m_object->get_accum() << '\n' << '\n'; 
         //change other states if has......
         m_mementoList.pop_back();
         m_commandList.pop_back();
-        m_index--;
     }
-    else if (m_index > 1) {      
-        std::list<std::unique_ptr<Memento>>::iterator tmp1 = m_mementoList.end();    // can use .back().get();
-        Memento *memp = (*--tmp1).get();
-        std::list<std::unique_ptr<Command>>::iterator tmp2 = m_commandList.end();
-        Command *cmdp = (*--tmp2).get();
+    else if (m_commandList.size() > 1) {      
+        Memento &mem = m_mementoList.back();
+        Record &cmd = m_commandList.back();
 
-        if(cmdp->m_x == 1){  
-            cmdp->m_object->set_accum(memp->m_object.get_accum()-1);  
-            std::cout << "\nUndo() is executed to -1, now m_accum = " << cmdp->m_object->get_accum() << '\n' << '\n';  
-        }else if(cmdp->m_x == 2){
-            cmdp->m_object->set_accum(memp->m_object.get_accum()/2);
-            std::cout << "\nUndo() is executed to /2, now m_accum = " << cmdp->m_object->get_accum() << '\n' << '\n';  
+        if(cmd.m_x == 1){  
+            m_object->set_accum(mem.m_object.get_accum()-cmd.m_count);  
+            if(m_verbose)
+                std::cout << "\nUndo() is executed to -" << cmd.m_count << ", now m_accum = " << m_object->get_accum() << '\n' << '\n';  
+        }else if(cmd.m_x == 2){
+            int accum = mem.m_object.get_accum();
+            for(int i = 0; i < cmd.m_count; i++)
+                accum /= 2;
+            m_object->set_accum(accum);
+            if(m_verbose)
+                std::cout << "\nUndo() is executed to /2 x " << cmd.m_count << ", now m_accum = " << m_object->get_accum() << '\n' << '\n';  
         }
         //... if there are more states, retore them
 
         m_mementoList.pop_back();   // remove the undo-ed entries
         m_commandList.pop_back();
-        m_index--;
     }
-    else if (m_index == 0)
+    else if(m_verbose)
         std::cout << "Can not execute undo, no command has be execute!"  << '\n';
 };   
 
@@ -186,11 +1487,697 @@ class UserInput{
         }   
 };
 
-int main(){
+// Reads a whole command script instead of one number per prompt. A file is mapped read only, so is
+// stdin ("-") when it is redirected from a file, a pipe is read into a buffer. Numbers are separated
+// by white space or commas and '#' comments out the rest of the line. next_batch() parses them with
+// std::from_chars straight out of the buffer.
+class ScriptInput {
+    public:
+        ScriptInput() = default;
+        ScriptInput(const ScriptInput &) = delete;
+        ScriptInput &operator=(const ScriptInput &) = delete;
+        ~ScriptInput(){
+            if(m_map != nullptr)
+                ::munmap(m_map, m_length);
+        }
+
+        bool open(const char *path){
+            int fd = std::strcmp(path, "-") == 0 ? 0 : ::open(path, O_RDONLY);
+            if(fd < 0)
+                return false;
+            struct stat st{};
+            if(::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+                void *map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(map != MAP_FAILED){
+                    ::madvise(map, st.st_size, MADV_SEQUENTIAL);
+                    m_map = map;
+                    m_length = st.st_size;
+                    m_pos = static_cast<const char *>(map);
+                    m_end = m_pos + m_length;
+                }
+            }
+            if(m_map == nullptr){
+                char buf[65536];
+                ssize_t n;
+                while((n = ::read(fd, buf, sizeof(buf))) > 0)
+                    m_buffer.append(buf, n);
+                m_pos = m_buffer.data();
+                m_end = m_pos + m_buffer.size();
+            }
+            if(fd != 0)
+                ::close(fd);
+            return true;
+        }
+
+        // Parses up to max numbers into out, returns how many, 0 at the end of the script.
+        std::size_t next_batch(std::vector<int> &out, std::size_t max){
+            out.clear();
+            while(out.size() < max && m_pos < m_end){
+                if(separator(*m_pos)){
+                    m_pos++;
+                    continue;
+                }
+                if(*m_pos == '#'){
+                    const void *eol = std::memchr(m_pos, '\n', m_end - m_pos);
+                    m_pos = eol ? static_cast<const char *>(eol) : m_end;
+                    continue;
+                }
+                int value;
+                std::from_chars_result res = std::from_chars(m_pos, m_end, value);
+                if(res.ec == std::errc() && (res.ptr == m_end || separator(*res.ptr) || *res.ptr == '#')){
+                    out.push_back(value);
+                    m_pos = res.ptr;
+                }
+                else {                                   // not a number, skip the token
+                    m_bad++;
+                    while(m_pos < m_end && !separator(*m_pos))
+                        m_pos++;
+                }
+            }
+            return out.size();
+        }
+
+        std::size_t bad() const { return m_bad; }    // tokens that were not numbers
+
+    private:
+        static bool separator(char c) { return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == ','; }
+
+        void *m_map = nullptr;
+        std::size_t m_length = 0;
+        std::string m_buffer;
+        const char *m_pos = nullptr;
+        const char *m_end = nullptr;
+        std::size_t m_bad = 0;
+};
+
+#define SCRIPT_BATCH 4096                // commands parsed per batch
+
+// Feeds a command script to the undo manager, the same numbers as the interactive loop, 0 stops.
+// Returns the number of commands handled.
+std::size_t run_script(ScriptInput &script, UndoHistoryBase &manager, Command &cmd1, Command &cmd2) {
+    std::vector<int> batch;
+    std::size_t handled = 0;
+    while(script.next_batch(batch, SCRIPT_BATCH) > 0)
+        for(int command : batch){
+            switch(command){
+                case 0:
+                    return handled;
+                case 1:
+                    cmd1.execute(command);
+                    break;
+                case 2:
+                    cmd2.execute(command);
+                    break;
+                case 3:
+                    manager.redo();
+                    break;
+                case 4:
+                    manager.undo();
+                    break;
+                default:
+                    std::cout << "Invalid command " << command << "!\n";
+                    continue;
+            }
+            handled++;
+        }
+    return handled;
+}
+
+#ifdef RUN_BENCHMARK
+static std::atomic<std::size_t> g_allocations{0};      // counts every operator new in the benchmark build
+
+void *operator new(std::size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+// Once these are inlined into a delete expression gcc 12 pairs the free() with that new expression 
+// and flags a mismatch, although this operator new is the one that called malloc().
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+
+// 4 MB object, every step changes the accumulator and a few small spots of the data. Compares full 
+// Memento copies with DeltaHistory: memory per history entry and the latency of one undo (restore the 
+// entry before the newest one).
+void bench_delta_memento() {
+    const std::size_t data_size = 4 << 20;
+    const int steps = MAX_NUM_UNDO;
+    const std::size_t intervals[] = {1, 4, 16, 64};
+
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<std::size_t> position(0, data_size - 256);
+
+    for(std::size_t interval : intervals){
+        Object object(0, data_size);
+        DeltaHistory history(interval);
+        for(int i = 0; i < steps; i++){
+            object.func1(1);
+            for(int n = 0; n < 3; n++)
+                object.data().fill(position(generator), i, 100);
+            history.push(object);
+        }
+
+        Object restored(0);
+        auto start = std::chrono::steady_clock::now();
+        const int rounds = 64;             // undo from every position within a keyframe interval
+        for(int r = 0; r < rounds; r++)
+            history.restore(history.size() - 2 - r % interval, restored);
+        std::chrono::duration<double, std::micro> undo = (std::chrono::steady_clock::now() - start) / rounds;
+
+        std::cout << "keyframe interval " << interval << ": " << history.memory() / history.size() 
+                  << " bytes per entry (full copy " << data_size << "), undo " 
+                  << undo.count() << " us\n";
+    }
+}
+
+// 10M execute/undo operations through Command with the history ring full.
+void bench_ring_history() {
+    const long operations = 10000000;
+    Object object(0);
+    UndoManager manager(&object);
+    Command cmd1(&manager, &Object::func1);
+    Command cmd2(&manager, &Object::func2);
+    manager.set_verbose(false);
+    for(int i = 0; i < MAX_NUM_UNDO; i++)
+        cmd1.execute(1);
+
+    std::size_t allocations = g_allocations.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    for(long i = 0; i < operations; i += 4){
+        cmd1.execute(1);
+        cmd2.execute(2);
+        manager.undo();
+        cmd1.execute(1);        // evicts the oldest entry
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    allocations = g_allocations.load(std::memory_order_relaxed) - allocations;
+
+    std::cout << operations << " execute/undo operations: " << elapsed.count() << " s, " 
+              << elapsed.count() * 1e9 / operations << " ns/op, " << allocations << " allocations\n";
+}
+
+// Many documents, each with its own UndoManager, edited by 1 up to hardware_concurrency threads. 
+// Every thread owns a disjoint set of documents.
+void bench_document_scaling() {
+    const int num_documents = 10000;
+    const long operations = 20000000;
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned> thread_counts;
+    for(unsigned n = 1; n < max_threads; n *= 2)
+        thread_counts.push_back(n);
+    thread_counts.push_back(max_threads);
+
+    for(unsigned num_threads : thread_counts){
+        std::vector<std::unique_ptr<Object>> objects;
+        std::vector<std::unique_ptr<UndoManager>> managers;
+        for(int d = 0; d < num_documents; d++){
+            objects.push_back(std::make_unique<Object>(0));
+            managers.push_back(std::make_unique<UndoManager>(objects.back().get(), 16));
+            managers.back()->set_verbose(false);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for(unsigned t = 0; t < num_threads; t++)
+            threads.emplace_back([&managers, t, num_threads, operations](){
+                long ops = 0;
+                for(int d = t; ops < operations / static_cast<long>(num_threads); d += num_threads){
+                    if(d >= num_documents)
+                        d = t;
+                    UndoManager *mgr = managers[d].get();
+                    Command cmd1(mgr, &Object::func1);
+                    Command cmd2(mgr, &Object::func2);
+                    cmd1.execute(1);
+                    cmd2.execute(2);
+                    mgr->undo();
+                    cmd1.execute(1);
+                    ops += 4;
+                }
+            });
+        for(std::thread &th : threads)
+            th.join();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << num_documents << " documents, " << num_threads << " thread(s): " 
+                  << operations / elapsed.count() << " ops/s\n";
+    }
+}
+
+// Undo/redo latency on a 4 MB object for commands that write all over the data, UNDO_SNAPSHOT assigns a 
+// memento, against restoring a full copy of the data (what a deep copied Memento costs).
+void bench_snapshot_undo() {
+    const std::size_t data_size = 4 << 20;
+    const int steps = MAX_NUM_UNDO;
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<std::size_t> position(0, data_size - PAGE_SIZE);
+
+    Object object(0, data_size);
+    UndoManager manager(&object);
+    manager.set_verbose(false);
+    Command edit(&manager, [&generator, &position](Object *obj, int x){
+        obj->func1(x);
+        for(int n = 0; n < 16; n++)
+            obj->data().fill(position(generator), static_cast<unsigned char>(x), PAGE_SIZE);
+    });
+    for(int i = 0; i < steps; i++)
+        edit.execute(1);
+
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < steps; i++)
+        manager.undo();
+    std::chrono::duration<double, std::nano> undo = (std::chrono::steady_clock::now() - start) / steps;
+    start = std::chrono::steady_clock::now();
+    for(int i = 0; i < steps; i++)
+        manager.redo();
+    std::chrono::duration<double, std::nano> redo = (std::chrono::steady_clock::now() - start) / steps;
+
+    std::vector<unsigned char> full(data_size);
+    object.data().read(0, full.data(), full.size());
+    start = std::chrono::steady_clock::now();
+    for(int i = 0; i < steps; i++)
+        object.data().write(0, full.data(), full.size());
+    std::chrono::duration<double, std::nano> copy = (std::chrono::steady_clock::now() - start) / steps;
+
+    std::cout << "4 MB object, snapshot undo " << undo.count() << " ns, redo " << redo.count() 
+              << " ns, full copy restore " << copy.count() << " ns\n";
+}
+
+// Writes a 1 GB history file (256 records of a 4 MB object) through an UndoManager, then measures how 
+// long it takes to open it again and to load the newest record.
+void bench_history_reopen() {
+    const std::size_t data_size = 4 << 20;
+    const std::uint64_t history_bytes = 1ull << 30;
+    const std::string path = "/tmp/b_memento_history";
+    std::remove((path + ".seg").c_str());
+    std::remove((path + ".idx").c_str());
+
+    {
+        HistoryStore store;
+        if(!store.open(path)){
+            std::cout << "Can not open " << path << '\n';
+            return;
+        }
+        Object object(0, data_size);
+        UndoManager manager(&object);
+        manager.set_verbose(false);
+        manager.set_store(&store);
+        Command edit(&manager, [](Object *obj, int x){
+            obj->func1(x);
+            obj->data().fill(obj->get_accum() * PAGE_SIZE % obj->data_size(), static_cast<unsigned char>(obj->get_accum()), PAGE_SIZE);
+        });
+        auto start = std::chrono::steady_clock::now();
+        for(std::uint64_t written = 0; written < history_bytes; written += data_size)
+            edit.execute(1);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "history of " << store.size() << " records written in " << elapsed.count() << " s\n";
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    HistoryStore store;
+    store.open(path);
+    std::size_t records = store.size();
+    std::chrono::duration<double, std::micro> reopen = std::chrono::steady_clock::now() - start;
+    Object last(0);
+    start = std::chrono::steady_clock::now();
+    if(!store.load(records - 1, last))
+        std::cout << "newest record is damaged\n";
+    std::chrono::duration<double, std::micro> load = std::chrono::steady_clock::now() - start;
+    std::cout << "1 GB history reopened in " << reopen.count() << " us (" << records << " records), newest record loaded in " 
+              << load.count() << " us, m_accum = " << last.get_accum() << '\n';
+
+    store.close();
+    std::remove((path + ".seg").c_str());
+    std::remove((path + ".idx").c_str());
+}
+
+// 4 MB object, every step rewrites 8 pages with text, 100 entries of which the newest 16 stay hot. Reports 
+// the compression ratio of the cold tier, the CPU the compressor thread used, and the undo latency in the 
+// hot and in the cold tier.
+void bench_tiered_history() {
+    const std::size_t data_size = 4 << 20;
+    const int steps = MAX_NUM_UNDO;
+    const char *words[] = {"state ", "object ", "memento ", "undo ", "redo ", "command ", "value ", "the ", "of ", "and "};
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<std::size_t> page(0, data_size / PAGE_SIZE - 1);
+
+    Object object(0, data_size);
+    TieredHistory history(16, MAX_NUM_UNDO);
+    std::vector<unsigned char> text(PAGE_SIZE);
+    for(int i = 0; i < steps; i++){
+        object.func1(1);
+        for(int n = 0; n < 8; n++){
+            for(std::size_t pos = 0; pos < text.size(); ){
+                const char *w = words[generator() % 10];
+                for(; *w && pos < text.size(); w++)
+                    text[pos++] = *w;
+            }
+            object.data().write(page(generator) * PAGE_SIZE, text.data(), text.size());
+        }
+        history.push(object);
+    }
+    history.wait_idle();
+    TieredHistory::Stats st = history.stats();
+
+    double hot_us = 0, cold_us = 0;
+    int hot_n = 0, cold_n = 0;
+    std::size_t before = st.deep_undos;
+    while(true){
+        auto start = std::chrono::steady_clock::now();
+        if(!history.pop(object))
+            break;
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        TieredHistory::Stats now = history.stats();
+        if(now.deep_undos != before){
+            cold_us += us;
+            cold_n++;
+        } else {
+            hot_us += us;
+            hot_n++;
+        }
+        before = now.deep_undos;
+    }
+
+    std::cout << st.cold_entries << " cold entries, " << st.raw_bytes << " -> " << st.compressed_bytes 
+              << " bytes, ratio " << static_cast<double>(st.raw_bytes) / st.compressed_bytes << ", compressor CPU " 
+              << st.compress_cpu_s * 1e3 << " ms (" << st.compress_cpu_s * 1e6 / st.cold_entries << " us/entry)\n";
+    std::cout << "undo latency: hot " << hot_us / hot_n << " us, cold (decompress) " << cold_us / cold_n 
+              << " us, m_accum = " << object.get_accum() << '\n';
+}
+
+// A high frequency edit stream: 1000 "plus one" followed by one "multiply two", 10 times over. Compares 
+// history entries and the time per command with and without coalescing, then undoes everything.
+void bench_coalescing() {
+    const int bursts = 10;
+    const int burst = 1000;
+    const UndoGranularity policies[] = {UNDO_EVERY_COMMAND, UNDO_COALESCE};
+    const char *names[] = {"every command", "coalesce     "};
+
+    for(int p = 0; p < 2; p++){
+        Object object(0);
+        UndoManager manager(&object, bursts * (burst + 1));
+        manager.set_verbose(false);
+        manager.set_granularity(policies[p]);
+        Command cmd1(&manager, &Object::func1);
+        Command cmd2(&manager, &Object::func2);
+
+        auto start = std::chrono::steady_clock::now();
+        for(int b = 0; b < bursts; b++){
+            for(int i = 0; i < burst; i++)
+                cmd1.execute(1);
+            cmd2.execute(2);
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        std::size_t entries = manager.size();
+        int undos = 0;
+        for(; manager.size(); undos++)
+            manager.undo();
+
+        std::cout << names[p] << ": " << bursts * (burst + 1) << " commands, " << entries << " history entries, " 
+                  << elapsed.count() / (bursts * (burst + 1)) << " ns/command, " << undos 
+                  << " undos back to m_accum = " << object.get_accum() << '\n';
+    }
+}
+
+// 64 branches of 16 commands each, every branch starts from a random node of the tree, every command 
+// rewrites one page of a 4 MB object. Counts the distinct pages and page table nodes the tree holds on to 
+// and times jumps between random nodes.
+void bench_undo_tree() {
+    const std::size_t data_size = 4 << 20;
+    const int branches = 64;
+    const int depth = 16;
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<std::size_t> page(0, data_size / PAGE_SIZE - 1);
+
+    Object object(0, data_size);
+    UndoTree tree(&object);
+    tree.set_verbose(false);
+    Command edit(&tree, [&generator, &page](Object *obj, int x){
+        obj->func1(x);
+        obj->data().fill(page(generator) * PAGE_SIZE, static_cast<unsigned char>(obj->get_accum()), PAGE_SIZE);
+    });
+    for(int b = 0; b < branches; b++){
+        tree.go_to(static_cast<int>(generator() % tree.size()));
+        for(int d = 0; d < depth; d++)
+            edit.execute(1);
+    }
+
+    std::vector<const unsigned char *> pages;
+    std::vector<const void *> tables;
+    for(std::size_t n = 0; n < tree.size(); n++){
+        const PagedData &data = tree.state(static_cast<int>(n)).data();
+        data.table_nodes(tables);
+        for(std::size_t p = 0; p < data.num_pages(); p++)
+            pages.push_back(data.page(p));
+    }
+    std::sort(pages.begin(), pages.end());
+    std::size_t distinct = std::unique(pages.begin(), pages.end()) - pages.begin();
+    std::sort(tables.begin(), tables.end());
+    std::size_t distinct_tables = std::unique(tables.begin(), tables.end()) - tables.begin();
+    std::size_t table_bytes = distinct_tables * PagedData::table_node_bytes();
+
+    const int jumps = 100000;
+    std::size_t path_nodes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int j = 0; j < jumps; j++){
+        int to = static_cast<int>(generator() % tree.size());
+        path_nodes += tree.path(tree.current(), to).size();
+        tree.go_to(to);
+    }
+    std::chrono::duration<double, std::nano> elapsed = (std::chrono::steady_clock::now() - start) / jumps;
+
+    std::cout << tree.size() << " nodes in " << branches << " branches: " << distinct * PAGE_SIZE / 1024 
+              << " KB of pages + " << table_bytes / 1024 << " KB of page table nodes (full copies " 
+              << tree.size() * data_size / 1024 << " KB), jump to a random node " << elapsed.count() << " ns, " << static_cast<double>(path_nodes) / jumps << " nodes on the path\n";
+}
+
+// A writer keeps changing a 4 MB object (one 256 byte write per command, within a 256 KB region that 
+// moves along, edits have locality) for 2 s while a snapshot is taken every millisecond. Writer 
+// throughput without snapshots, with the writer deep copying the data itself (what a Memento of a flat 
+// object costs), and with SnapshotChannel where a background thread takes the snapshot and checksums 
+// all of it.
+void bench_concurrent_snapshot() {
+    const std::size_t data_size = 4 << 20;
+    const std::chrono::milliseconds duration(2000);
+    const std::chrono::microseconds interval(1000);
+    const char *names[] = {"no snapshots         ", "synchronous deep copy", "SnapshotChannel      "};
+
+    for(int mode = 0; mode < 3; mode++){
+        Object object(0, data_size);
+        SnapshotChannel channel(&object);
+        std::vector<unsigned char> copy(data_size);
+        std::atomic<long> snapshots{0};
+        std::atomic<unsigned> checksum{0};
+        std::thread taker;
+        if(mode == 2)
+            taker = std::thread([&channel, &snapshots, &checksum, interval](){
+                Memento mem;
+                unsigned sum = 0;
+                while(true){
+                    std::this_thread::sleep_for(interval);
+                    if(!channel.take(mem))
+                        break;
+                    const PagedData &data = mem.m_object.data();
+                    for(std::size_t p = 0; p < data.num_pages(); p++)
+                        for(std::size_t i = 0; i < data.page_size(p); i += 64)
+                            sum += data.page(p)[i];
+                    snapshots++;
+                }
+                channel.give_back(mem);
+                checksum.store(sum, std::memory_order_relaxed);
+            });
+
+        std::mt19937 generator(42);
+        long commands = 0;
+        auto start = std::chrono::steady_clock::now();
+        auto next_copy = start + interval;
+        for(auto now = start; now - start < duration; now = std::chrono::steady_clock::now()){
+            for(int i = 0; i < 1000; i++, commands++){
+                object.func1(1);
+                std::size_t region = (commands >> 16) * (256 << 10) % data_size;
+                object.data().fill(region + generator() % ((256 << 10) - 256), static_cast<unsigned char>(i), 256);
+                channel.checkpoint();
+            }
+            if(mode == 1 && now >= next_copy){
+                object.data().read(0, copy.data(), copy.size());
+                snapshots++;
+                next_copy = now + interval;
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        channel.close();
+        if(taker.joinable())
+            taker.join();
+
+        std::cout << names[mode] << ": " << commands / elapsed.count() << " commands/s, " << snapshots 
+                  << " snapshots";
+        if(mode == 2)
+            std::cout << ", checksum " << checksum.load(std::memory_order_relaxed);
+        std::cout << '\n';
+    }
+}
+
+// 10000 deterministic commands on a 4 MB object, each rewriting part of one of 16 hot pages, all of them 
+// kept undoable. For a range of checkpoint intervals (1 is a memento per command): the memory the 
+// checkpoints, their page table nodes and the log hold on to, and the time to restore a random point.
+void bench_checkpoint_history() {
+    const std::size_t data_size = 4 << 20;
+    const int commands = 10000;
+    const std::size_t intervals[] = {1, 10, 100, 1000};
+    Mfuncp edit = [](Object *obj, int x){
+        obj->func1(x);
+        std::size_t page = static_cast<std::size_t>(obj->get_accum()) * 7919 % 16;
+        obj->data().fill(page * PAGE_SIZE, static_cast<unsigned char>(obj->get_accum()), 512);
+    };
+
+    for(std::size_t interval : intervals){
+        Object object(0, data_size);
+        CheckpointHistory history(&object, interval, commands);
+        history.set_verbose(false);
+        Command cmd(&history, edit);
+        for(int i = 0; i < commands; i++)
+            cmd.execute(1);
+
+        std::vector<const unsigned char *> pages;
+        std::vector<const void *> tables;
+        for(std::size_t c = 0; c < history.checkpoints(); c++){
+            const PagedData &data = history.checkpoint(c).data();
+            data.table_nodes(tables);
+            for(std::size_t p = 0; p < data.num_pages(); p++)
+                pages.push_back(data.page(p));
+        }
+        std::sort(pages.begin(), pages.end());
+        std::sort(tables.begin(), tables.end());
+        std::size_t memory = (std::unique(pages.begin(), pages.end()) - pages.begin()) * PAGE_SIZE 
+                             + (std::unique(tables.begin(), tables.end()) - tables.begin()) * PagedData::table_node_bytes()
+                             + history.size() * sizeof(Mfuncp);
+
+        std::mt19937 generator(42);
+        const int restores = 200;
+        Object restored(0);
+        auto start = std::chrono::steady_clock::now();
+        for(int r = 0; r < restores; r++)
+            history.restore(generator() % (commands + 1), restored);
+        std::chrono::duration<double, std::micro> elapsed = (std::chrono::steady_clock::now() - start) / restores;
+
+        std::cout << "checkpoint every " << interval << " commands: " << history.checkpoints() << " checkpoints, " 
+                  << memory / 1024 << " KB, restore " << elapsed.count() << " us\n";
+    }
+}
+
+// 10M command script, one command per line, through ScriptInput into the undo manager, against
+// reading the same file one number at a time with >> and ignore(), which is what UserInput does.
+// Both managers are not verbose, so neither run prints anything.
+void bench_script_input() {
+    const std::size_t num_commands = 10000000;
+    const char *path = "/tmp/b_memento_script.txt";
+    {
+        const char weighted[] = "1111222334444444";      // more undo than multiply keeps m_accum small
+        std::mt19937 generator(42);
+        std::string text;
+        for(std::size_t i = 0; i < num_commands; i++){
+            text += weighted[generator() % 16];
+            text += '\n';
+        }
+        std::FILE *fp = std::fopen(path, "wb");
+        if(fp == nullptr || std::fwrite(text.data(), 1, text.size(), fp) != text.size()){
+            std::cout << "can not write " << path << '\n';
+            return;
+        }
+        std::fclose(fp);
+    }
+
+    Object streamed_object(0);
+    UndoManager streamed_manager(&streamed_object);
+    streamed_manager.set_verbose(false);
+    Command s_cmd1(&streamed_manager, &Object::func1);
+    Command s_cmd2(&streamed_manager, &Object::func2);
+    auto start = std::chrono::steady_clock::now();
+    std::ifstream in(path);
+    double user_in{};
+    std::size_t n_stream = 0;
+    while(in >> user_in){
+        in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        if(user_in == 1)
+            s_cmd1.execute(user_in);
+        else if(user_in == 2)
+            s_cmd2.execute(user_in);
+        else if(user_in == 3)
+            streamed_manager.redo();
+        else if(user_in == 4)
+            streamed_manager.undo();
+        n_stream++;
+    }
+    std::chrono::duration<double> t_stream = std::chrono::steady_clock::now() - start;
+
+    Object scripted_object(0);
+    UndoManager scripted_manager(&scripted_object);
+    scripted_manager.set_verbose(false);
+    Command cmd1(&scripted_manager, &Object::func1);
+    Command cmd2(&scripted_manager, &Object::func2);
+    start = std::chrono::steady_clock::now();
+    ScriptInput script;
+    script.open(path);
+    std::size_t n_script = run_script(script, scripted_manager, cmd1, cmd2);
+    std::chrono::duration<double> t_script = std::chrono::steady_clock::now() - start;
+    std::remove(path);
+
+    std::cout << num_commands << " commands, end to end\n";
+    std::cout << ">> and ignore(): " << n_stream / t_stream.count() << " commands/s\n";
+    std::cout << "ScriptInput:     " << n_script / t_script.count() << " commands/s\n";
+    if(streamed_object.get_accum() != scripted_object.get_accum())
+        std::cout << "final accumulators differ!\n";
+}
+#endif
+
+static int usage(const char *prog){
+    std::cout << "usage: " << prog << "                        interactive\n"
+              << "       " << prog << " --script <file or ->   run a command script\n";
+    return 1;
+}
+
+int main(int argc, char *argv[]){
+
+    if(argc > 1 && std::strcmp(argv[1], "--script") == 0){       // b_memento --script <file or ->
+        if(argc != 3)
+            return usage(argv[0]);
+        Object object(0);
+        UndoManager manager(&object);
+        Command cmd1(&manager, &Object::func1);
+        Command cmd2(&manager, &Object::func2);
+        ScriptInput script;
+        if(!script.open(argv[2])){
+            std::cout << "can not open " << argv[2] << '\n';
+            return 1;
+        }
+        std::size_t handled = run_script(script, manager, cmd1, cmd2);
+        std::cout << handled << " commands, " << script.bad() << " invalid tokens, m_accum = " << object.get_accum() << '\n';
+        return 0;
+    }
+    if(argc > 1)
+        return usage(argv[0]);
+
+#ifdef RUN_BENCHMARK
+    bench_delta_memento();
+    bench_ring_history();
+    bench_document_scaling();
+    bench_snapshot_undo();
+    bench_history_reopen();
+    bench_tiered_history();
+    bench_coalescing();
+    bench_undo_tree();
+    bench_concurrent_snapshot();
+    bench_checkpoint_history();
+    bench_script_input();
+    return 0;
+#endif
     
     Object object(0);
-    Command cmd1(&object, &Object::func1);   // plus 1
-    Command cmd2(&object, &Object::func2);   // multiply 2
+    UndoManager manager(&object);
+    Command cmd1(&manager, &Object::func1);   // plus 1
+    Command cmd2(&manager, &Object::func2);   // multiply 2
     UserInput uinput{};
     double user_in{};
 
@@ -214,10 +2201,10 @@ int main(){
             cmd2.execute(user_in);
         }
         else if(user_in == 3){
-            Command::redo();
+            manager.redo();
         }
         else if(user_in == 4){
-            Command::undo();
+            manager.undo();
         }
         else
             std::cout << "Error happened!\n";
@@ -16,23 +16,57 @@
 #include <chrono>
 #include <mutex>
 #include <memory>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+
+//#define RUN_BENCHMARK                  // run the dispatch benchmark instead of the demo
+
+#define MAX_EVENT_TYPES 64               // one bit per event type in an EventMask
+
+typedef std::uint64_t EventMask;
+const EventMask ALL_EVENTS = ~EventMask{0};
 
 class Publisher; 
 
+std::vector<std::string> data_events{"State-1 changed, ", "State-2 changed, ", "State-3 changed, ", "State-4 changed, ", "State-5 changed, ", "State-6 changed, "};
+
+// An event as it travels from a publisher through the FanIn to the observers.
+struct Event {
+	int publisher;               // id of the publisher
+	std::uint64_t seq;           // per publisher sequence number, starts from 1
+	std::uint64_t timestamp;     // steady_clock nanoseconds when published
+	int type;                    // index into data_events
+};
+
 class ObserverBase{
 	public:
 		virtual ~ObserverBase() = default;
-		virtual void update(std::string str) = 0;
+		virtual void update(const std::string &str) = 0;
 		virtual void display_msg() = 0;
 		virtual int get_id() const = 0;
+
+		// Called by the FanIn, in merged order.
+		virtual void onEvent(const Event &ev) { update(data_events[ev.type]); }
+		// Events [expected, received) of the publisher never arrived.
+		virtual void onGap(int publisher, std::uint64_t expected, std::uint64_t received) {
+			std::cout << "Publisher-" << publisher << ": events " << expected << " to " << received - 1 << " lost\n";
+		}
+		// The event has been delivered before, it is not delivered again.
+		virtual void onDuplicate(int publisher, std::uint64_t seq) {
+			std::cout << "Publisher-" << publisher << ": duplicate event " << seq << " dropped\n";
+		}
 };
 
 class PublisherBase{
 	public:
 		virtual ~PublisherBase() = default;
-		virtual void addObserver(ObserverBase *) = 0;
+		virtual void addObserver(ObserverBase *, EventMask mask = ALL_EVENTS) = 0;
 		virtual void removeObserver(int id) = 0;
-		virtual void notification(std::string) = 0;
+		virtual void notification(std::string) = 0;      // broadcast to every observer
+		virtual void notification(int event) = 0;        // only observers subscribed to this event type
 
 };
 
@@ -41,7 +75,7 @@ class Observer_1 : public ObserverBase {
 		Observer_1(Publisher &pbls, int id = 1, int count = 0)
 			: m_publisher{pbls}, m_id{id}, m_count{count}{}
 		
-		void update(std::string str) override {
+		void update(const std::string &str) override {
 			m_mtx.lock();
 			m_msg_list.push_back(str);
 			m_mtx.unlock();
@@ -80,7 +114,7 @@ class Observer_2 : public ObserverBase {
 		Observer_2(Publisher &pbls, int id = 2, int count = 0)
 			: m_publisher{pbls}, m_id{id}, m_count{count}{}
 
-		void update(std::string str) override {
+		void update(const std::string &str) override {
 			if(m_msg_list.size() > MAX_MSG_LEN)
 				m_msg_list.pop_front();
 			m_msg_list.push_back(str);
@@ -106,33 +140,54 @@ class Observer_2 : public ObserverBase {
 		int m_count;
 };
 
-std::vector<std::string> data_events{"State-1 changed, ", "State-2 changed, ", "State-3 changed, ", "State-4 changed, ", "State-5 changed, ", "State-6 changed, "};
+class FanIn;
 
 class Publisher : public PublisherBase {
 	public:
 		Publisher() = default;
 		~Publisher() = default;
 		
-		void addObserver(ObserverBase *obsv) override {
-			m_observer_list.push_back(obsv);
+		// The mask selects the event types (bit n == data_events[n]) the observer wants to receive.
+		void addObserver(ObserverBase *obsv, EventMask mask = ALL_EVENTS) override {
+			m_observer_list.push_back({obsv, mask});
+			rebuildDispatch();
+		}
+
+		// Same as above, the predicate is evaluated once per event type here, never on the dispatch path.
+		void addObserver(ObserverBase *obsv, const std::function<bool(int)> &interested) {
+			EventMask mask = 0;
+			for(int ev = 0; ev < MAX_EVENT_TYPES; ev++)
+				if(interested(ev))
+					mask |= EventMask{1} << ev;
+			addObserver(obsv, mask);
 		}
 		
 		void removeObserver(int id) override {
-			for(std::list<ObserverBase *>::iterator it = m_observer_list.begin();
-				it != m_observer_list.end(); ++it){
-					if((*it)->get_id() == id){
-						m_observer_list.erase(it);
-					}
-				}
+			m_observer_list.remove_if([id](const Subscription &sub){ return sub.observer->get_id() == id; });
+			rebuildDispatch();
 		}
 		
 		void notification(std::string str) override {
-			for(std::list<ObserverBase *>::iterator it = m_observer_list.begin(); 
+			for(std::list<Subscription>::iterator it = m_observer_list.begin(); 
 				it != m_observer_list.end(); it++){
-					(*it)->update(str);
+					it->observer->update(str);
 				}
 		}
 
+		void notification(int event) override {
+			if(event < 0 || event >= MAX_EVENT_TYPES || event >= static_cast<int>(data_events.size()))
+				return;
+			const std::string &str = data_events[event];
+			for(ObserverBase *obsv : m_dispatch[event])
+				obsv->update(str);
+		}
+
+		// Send the event through the FanIn instead of notifying the observers directly. Only the thread 
+		// that owns this publisher may call publish().
+		void connect(FanIn &fanin);
+		bool publish(int event, bool drop_if_full = false);
+		void disconnect();
+
 		void dataSource() {
 			//while(1){
 			for(int i=0; i<50; i++){          // for test
@@ -141,22 +196,408 @@ class Publisher : public PublisherBase {
 				std::mt19937 generator(seed);
 				std::uniform_int_distribution<uint_least32_t> distribution(0, 5);
 				unsigned int rn = distribution(generator);
-				notification(data_events[rn]);
+				notification(static_cast<int>(rn));
 				std::this_thread::sleep_for(std::chrono::milliseconds(1000));
 			}
 		}
 
 	private:
-		std::list<ObserverBase *> m_observer_list;
+		struct Subscription {
+			ObserverBase *observer;
+			EventMask mask;
+		};
+
+		// Rebuild the per event type observer lists, observers that are not interested never show up in them.
+		void rebuildDispatch() {
+			for(std::vector<ObserverBase *> &lst : m_dispatch)
+				lst.clear();
+			for(const Subscription &sub : m_observer_list)
+				for(int ev = 0; ev < MAX_EVENT_TYPES; ev++)
+					if(sub.mask & (EventMask{1} << ev))
+						m_dispatch[ev].push_back(sub.observer);
+		}
+
+		std::list<Subscription> m_observer_list;
+		std::vector<ObserverBase *> m_dispatch[MAX_EVENT_TYPES];
+		FanIn *m_fanin = nullptr;
+		int m_id = -1;
+		std::uint64_t m_seq = 0;
+};
+
+// Single producer single consumer ring, capacity is rounded up to a power of two.
+template <typename T>
+class SpscQueue {
+	public:
+		explicit SpscQueue(std::size_t capacity) {
+			std::size_t cap = 1;
+			while(cap < capacity)
+				cap <<= 1;
+			m_buffer.resize(cap);
+			m_mask = cap - 1;
+		}
+
+		bool push(const T &item) {
+			std::size_t tail = m_tail.load(std::memory_order_relaxed);
+			if(tail - m_head_cache > m_mask){
+				m_head_cache = m_head.load(std::memory_order_acquire);
+				if(tail - m_head_cache > m_mask)
+					return false;
+			}
+			m_buffer[tail & m_mask] = item;
+			m_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool pop(T &item) {
+			std::size_t head = m_head.load(std::memory_order_relaxed);
+			if(head == m_tail_cache){
+				m_tail_cache = m_tail.load(std::memory_order_acquire);
+				if(head == m_tail_cache)
+					return false;
+			}
+			item = m_buffer[head & m_mask];
+			m_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+	private:
+		std::vector<T> m_buffer;
+		std::size_t m_mask;
+		alignas(64) std::atomic<std::size_t> m_head{0};
+		std::size_t m_tail_cache = 0;          // consumer's copy of m_tail
+		alignas(64) std::atomic<std::size_t> m_tail{0};
+		std::size_t m_head_cache = 0;          // producer's copy of m_head
+};
+
+// Merges the event streams of several publishers, each publishing from its own thread, into one stream 
+// ordered by timestamp. Every publisher has its own SPSC input queue, which is FIFO, so a sequence number 
+// jump is a gap (dropped events) and a sequence number already seen is a duplicate as soon as it arrives. 
+// In-sequence events wait in a bounded per publisher ready buffer of m_window events, that is the 
+// reordering buffer: the oldest event is delivered once every live publisher has something ready (nothing 
+// older can still arrive), when a ready buffer is full, or when it is older than m_max_delay_ns.
+class FanIn {
+	public:
+		FanIn(std::size_t window = 1024, std::uint64_t max_delay_ns = 1000000, std::size_t queue_size = 65536)
+			: m_window{window}, m_max_delay_ns{max_delay_ns}, m_queue_size{queue_size}{}
+
+		void addObserver(ObserverBase *obsv) { m_observers.push_back(obsv); }
+
+		// Set up all publishers before the merge thread starts.
+		int connect() {
+			int id = static_cast<int>(m_streams.size());
+			m_streams.push_back(std::make_unique<Stream>(id, m_queue_size, m_window));
+			return id;
+		}
+		SpscQueue<Event> &input(int publisher) { return m_streams[publisher]->queue; }
+		// last_seq is the last sequence number the publisher used, so that lost events at the very end show up too.
+		void close(int publisher, std::uint64_t last_seq) {
+			m_streams[publisher]->last_seq = last_seq;
+			m_streams[publisher]->closed.store(true, std::memory_order_release);
+		}
+
+		// One merge step, returns the number of events delivered. Run it in a loop on the merge thread.
+		std::size_t poll() {
+			for(std::unique_ptr<Stream> &st : m_streams)
+				drain(*st);
+
+			std::size_t delivered = 0;
+			std::uint64_t now = now_ns();
+			while(true){
+				Stream *oldest = nullptr;
+				bool all_ready = true;
+				bool any_full = false;
+				for(std::unique_ptr<Stream> &st : m_streams){
+					if(st->ready_count == 0){
+						if(!st->finished)
+							all_ready = false;
+						continue;
+					}
+					if(st->ready_count == m_window)
+						any_full = true;
+					if(!oldest || st->front().timestamp < oldest->front().timestamp)
+						oldest = st.get();
+				}
+				if(!oldest)
+					break;
+				if(!all_ready && !any_full && oldest->front().timestamp + m_max_delay_ns > now)
+					break;
+				deliver(oldest->front());
+				oldest->pop_front();
+				delivered++;
+			}
+			return delivered;
+		}
+
+		// True when every publisher closed and all of its events have been delivered.
+		bool done() const {
+			for(const std::unique_ptr<Stream> &st : m_streams)
+				if(!st->finished || st->ready_count)
+					return false;
+			return true;
+		}
+
+		static std::uint64_t now_ns() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+	private:
+		struct Stream {
+			Stream(int publisher, std::size_t queue_size, std::size_t window)
+				: id{publisher}, queue{queue_size}, ready(window){}
+
+			const Event &front() const { return ready[ready_head]; }
+			void pop_front() { ready_head = (ready_head + 1) % ready.size(); ready_count--; }
+
+			int id;
+			SpscQueue<Event> queue;
+			std::atomic<bool> closed{false};
+			std::uint64_t last_seq = 0;          // valid once closed
+			bool finished = false;               // closed and the queue drained
+			std::uint64_t next_seq = 1;          // sequence number expected next
+			std::vector<Event> ready;            // in sequence order, waiting for the merge
+			std::size_t ready_head = 0;
+			std::size_t ready_count = 0;
+		};
+
+		void drain(Stream &st) {
+			if(st.finished)
+				return;
+			bool closed = st.closed.load(std::memory_order_acquire);   // read before the last pop
+			Event ev;
+			while(st.ready_count < m_window){
+				if(!st.queue.pop(ev)){
+					if(closed)
+						finish(st);
+					return;
+				}
+				accept(st, ev);
+			}
+		}
+
+		void finish(Stream &st) {
+			st.finished = true;
+			if(st.last_seq >= st.next_seq)
+				for(ObserverBase *obsv : m_observers)
+					obsv->onGap(st.id, st.next_seq, st.last_seq + 1);
+		}
+
+		void accept(Stream &st, const Event &ev) {
+			if(ev.seq < st.next_seq){
+				for(ObserverBase *obsv : m_observers)
+					obsv->onDuplicate(ev.publisher, ev.seq);
+				return;
+			}
+			if(ev.seq > st.next_seq)
+				for(ObserverBase *obsv : m_observers)
+					obsv->onGap(ev.publisher, st.next_seq, ev.seq);
+			st.next_seq = ev.seq + 1;
+			st.ready[(st.ready_head + st.ready_count) % m_window] = ev;
+			st.ready_count++;
+		}
+
+		void deliver(const Event &ev) {
+			for(ObserverBase *obsv : m_observers)
+				obsv->onEvent(ev);
+		}
+
+		std::size_t m_window;
+		std::uint64_t m_max_delay_ns;
+		std::size_t m_queue_size;
+		std::vector<std::unique_ptr<Stream>> m_streams;
+		std::vector<ObserverBase *> m_observers;
+};
+
+void Publisher::connect(FanIn &fanin) {
+	m_fanin = &fanin;
+	m_id = fanin.connect();
+	m_seq = 0;
+}
+
+void Publisher::disconnect() {
+	m_fanin->close(m_id, m_seq);
+	m_fanin = nullptr;
+}
+
+// Without drop_if_full the publisher waits for room in its queue. With it the event is dropped, it still 
+// consumes a sequence number so the observers see the gap.
+bool Publisher::publish(int event, bool drop_if_full) {
+	Event ev{m_id, ++m_seq, FanIn::now_ns(), event};
+	SpscQueue<Event> &queue = m_fanin->input(m_id);
+	while(!queue.push(ev)){
+		if(drop_if_full)
+			return false;
+		std::this_thread::yield();
+	}
+	return true;
+}
+
+#ifdef RUN_BENCHMARK
+// Observer used by the benchmark, only counts what it receives.
+class CountingObserver : public ObserverBase {
+	public:
+		CountingObserver(int id, EventMask mask = ALL_EVENTS) : m_id{id}, m_mask{mask}{}
+
+		void update(const std::string &str) override {
+			m_count++;
+			m_bytes += str.size();
+		}
+		void display_msg() override { std::cout << "Observer-" << m_id << ": " << m_count << " notifications\n"; }
+		int get_id() const override { return m_id; }
+
+		EventMask get_mask() const { return m_mask; }
+		long get_count() const { return m_count; }
+
+	private:
+		int m_id;
+		EventMask m_mask;
+		long m_count = 0;
+		std::size_t m_bytes = 0;
 };
 
+// Same observer filtering by itself, what it had to do before the publisher knew the masks.
+class SelfFilteringObserver : public CountingObserver {
+	public:
+		using CountingObserver::CountingObserver;
+
+		void update(const std::string &str) override {
+			std::string copy = str;          // the old by-value update(), the event type is the last character
+			if(get_mask() & (EventMask{1} << (copy.back() - '0')))
+				CountingObserver::update(copy);
+		}
+};
+
+// 1000 observers, 64 event types, every observer subscribes to a single event type (the closest to 1% a
+// 64 bit mask gets).
+void bench_filtered_dispatch() {
+	const int num_observers = 1000;
+	const int num_events = 100000;
+
+	data_events.clear();
+	for(int ev = 0; ev < MAX_EVENT_TYPES; ev++)
+		data_events.push_back("State-" + std::to_string(ev) + " changed, " + static_cast<char>('0' + ev));
+
+	std::vector<std::unique_ptr<CountingObserver>> filtered;
+	std::vector<std::unique_ptr<SelfFilteringObserver>> broadcast;
+	Publisher pbls_filtered;
+	Publisher pbls_broadcast;
+	for(int i = 0; i < num_observers; i++){
+		EventMask mask = EventMask{1} << (i % MAX_EVENT_TYPES);
+		filtered.push_back(std::make_unique<CountingObserver>(i, mask));
+		broadcast.push_back(std::make_unique<SelfFilteringObserver>(i, mask));
+		pbls_filtered.addObserver(filtered.back().get(), mask);
+		pbls_broadcast.addObserver(broadcast.back().get());
+	}
+
+	std::mt19937 generator(42);
+	std::uniform_int_distribution<int> distribution(0, MAX_EVENT_TYPES - 1);
+	std::vector<int> events(num_events);
+	for(int &ev : events)
+		ev = distribution(generator);
+
+	auto start = std::chrono::steady_clock::now();
+	for(int ev : events)
+		pbls_broadcast.notification(data_events[ev]);
+	std::chrono::duration<double> t_broadcast = std::chrono::steady_clock::now() - start;
+
+	start = std::chrono::steady_clock::now();
+	for(int ev : events)
+		pbls_filtered.notification(ev);
+	std::chrono::duration<double> t_filtered = std::chrono::steady_clock::now() - start;
+
+	long delivered_b = 0, delivered_f = 0;
+	for(int i = 0; i < num_observers; i++){
+		delivered_b += broadcast[i]->get_count();
+		delivered_f += filtered[i]->get_count();
+	}
+	std::cout << num_observers << " observers, " << num_events << " events, " << MAX_EVENT_TYPES << " event types\n";
+	std::cout << "broadcast + observer side filter: " << t_broadcast.count() << " s, " 
+		  << num_events / t_broadcast.count() << " events/s, delivered " << delivered_b << '\n';
+	std::cout << "per event type dispatch list:     " << t_filtered.count() << " s, " 
+		  << num_events / t_filtered.count() << " events/s, delivered " << delivered_f << '\n';
+}
+
+// Checks what comes out of the FanIn.
+class MergeCheckObserver : public CountingObserver {
+	public:
+		MergeCheckObserver(int id, int num_publishers) : CountingObserver{id}, m_last_seq(num_publishers, 0){}
+
+		void onEvent(const Event &ev) override {
+			m_events++;
+			if(ev.seq <= m_last_seq[ev.publisher])
+				m_seq_errors++;
+			m_last_seq[ev.publisher] = ev.seq;
+			if(ev.timestamp < m_last_timestamp)      // older than the event delivered just before
+				m_out_of_order++;
+			m_last_timestamp = ev.timestamp;
+		}
+		void onGap(int, std::uint64_t expected, std::uint64_t received) override { m_lost += received - expected; }
+		void onDuplicate(int, std::uint64_t) override { m_duplicates++; }
+
+		void report() const {
+			std::cout << "delivered " << m_events << ", lost " << m_lost << ", duplicates " << m_duplicates 
+				  << ", sequence errors " << m_seq_errors << ", out of timestamp order " << m_out_of_order << '\n';
+		}
+
+	private:
+		std::vector<std::uint64_t> m_last_seq;
+		std::uint64_t m_last_timestamp = 0;
+		long m_events = 0;
+		long m_lost = 0;
+		long m_duplicates = 0;
+		long m_seq_errors = 0;
+		long m_out_of_order = 0;
+};
+
+// 8 publisher threads feeding one FanIn, merged on this thread.
+void bench_fan_in() {
+	const int num_publishers = 8;
+	const int events_per_publisher = 1000000;
+
+	FanIn fanin(4096);
+	MergeCheckObserver checker(0, num_publishers);
+	fanin.addObserver(&checker);
+	std::vector<std::unique_ptr<Publisher>> publishers;
+	for(int i = 0; i < num_publishers; i++){
+		publishers.push_back(std::make_unique<Publisher>());
+		publishers.back()->connect(fanin);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for(int i = 0; i < num_publishers; i++)
+		threads.emplace_back([&publishers, i, events_per_publisher](){
+			for(int n = 0; n < events_per_publisher; n++)
+				publishers[i]->publish(n % static_cast<int>(data_events.size()));
+			publishers[i]->disconnect();
+		});
+	while(!fanin.done())
+		if(fanin.poll() == 0)
+			std::this_thread::yield();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	for(std::thread &th : threads)
+		th.join();
+
+	std::cout << num_publishers << " publisher threads, " << events_per_publisher << " events each: " 
+		  << elapsed.count() << " s, " << num_publishers * static_cast<double>(events_per_publisher) / elapsed.count() 
+		  << " events/s\n";
+	checker.report();
+}
+#endif
+
 int main(){
 
+#ifdef RUN_BENCHMARK
+	bench_filtered_dispatch();
+	bench_fan_in();
+	return 0;
+#endif
+
 	std::shared_ptr<Publisher> pbls = std::make_shared<Publisher>();
 	std::shared_ptr<Observer_1> obs1 = std::make_shared<Observer_1>(*pbls.get(), 1, 0);
 	std::shared_ptr<Observer_2> obs2 = std::make_shared<Observer_2>(*pbls.get(), 2, 0);
 	pbls->addObserver(obs1.get());
-	pbls->addObserver(obs2.get());
+	pbls->addObserver(obs2.get(), [](int ev){ return ev < 3; });     // observer-2 only cares about State-1 to State-3
 
 	std::thread th2(&Publisher::dataSource, pbls.get());
 	std::thread th1(&Observer_1::display_msg, obs1.get());
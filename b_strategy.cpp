@@ -20,37 +20,66 @@
 
 #include <iostream>
 #include <algorithm>
+#include <functional>
 #include <string_view>
 #include <memory>
 #include <string>
 #include <vector>
 #include <limits>
+#include <chrono>
+#include <random>
+#include <charconv>
+#include <system_error>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+//#define RUN_BENCHMARK       // run the benchmarks instead of the interactive demo
 
 class AlgorithmBase {
     public:
         virtual ~AlgorithmBase() = default;
         virtual std::string doAlgorithm(std::string_view st) const = 0;
+        virtual std::string process(std::string_view st) const = 0;       // the work alone, no output, for timing
 
 };
 
-// Sort string decendingly
+// Sort string acendingly
 class Algorithm_0 : public AlgorithmBase {
     public:
         std::string doAlgorithm(std::string_view st) const override {
-            std::string result(st);
-            std::sort(result.begin(), result.end());
+            std::string result = process(st);
             std::cout << result << ": Sorted acendingly\n";
             return result;
         } 
+        std::string process(std::string_view st) const override {
+            std::string result(st);
+            std::sort(result.begin(), result.end());
+            return result;
+        }
 };
 
-// sort string acendingly
+// sort string decendingly
 class Algorithm_1 : public AlgorithmBase {
     public:
         std::string doAlgorithm(std::string_view st) const override {
+            std::string result = process(st);
+            std::cout << result << ": Sorted decendingly\n";
+            return result;
+        }
+        std::string process(std::string_view st) const override {
             std::string result(st);
             std::sort(result.begin(), result.end(), [](int a, int b){return a > b;});     // sort decendingly use lambda
-            std::cout << result << ": Sorted decendingly\n";
             return result;
         }
 };
@@ -59,17 +88,280 @@ class Algorithm_1 : public AlgorithmBase {
 class Algorithm_2: public AlgorithmBase {
     public:
         std::string doAlgorithm(std::string_view st) const override {
+            std::string result = process(st);
+            std::cout << result << ": String has be reversed.\n"; 
+            return result;
+        }
+        std::string process(std::string_view st) const override {
             std::string result(st);
             std::reverse(result.begin(), result.end());
-            std::cout << result << ": String has be reversed.\n"; 
             return result;
         }
 };
 
+// Byte histogram of st. Eight bytes are loaded at a time and spread over four sub-histograms, so a
+// run of one character does not make every increment wait for the previous one; the sub-histograms
+// are summed at the end. They are 32 bit to stay in L1 and are folded into count every 1 GB.
+void byte_histogram(std::string_view st, std::uint64_t (&count)[256]){
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(st.data());
+    std::size_t n = st.size();
+    std::fill(std::begin(count), std::end(count), 0);
+    if(n < 256){                                          // clearing the sub-histograms would cost more
+        for(std::size_t i = 0; i < n; i++)
+            count[p[i]]++;
+        return;
+    }
+    std::uint32_t lane[4][256];
+    while(n > 0){
+        std::size_t len = std::min<std::size_t>(n, std::size_t(1) << 30);
+        std::memset(lane, 0, sizeof(lane));
+        std::size_t i = 0;
+        for(; i + 8 <= len; i += 8){
+            std::uint64_t w;
+            std::memcpy(&w, p + i, 8);
+            lane[0][w & 0xff]++;
+            lane[1][(w >> 8) & 0xff]++;
+            lane[2][(w >> 16) & 0xff]++;
+            lane[3][(w >> 24) & 0xff]++;
+            lane[0][(w >> 32) & 0xff]++;
+            lane[1][(w >> 40) & 0xff]++;
+            lane[2][(w >> 48) & 0xff]++;
+            lane[3][w >> 56]++;
+        }
+        for(; i < len; i++)
+            lane[0][p[i]]++;
+        for(int c = 0; c < 256; c++)
+            count[c] += std::uint64_t(lane[0][c]) + lane[1][c] + lane[2][c] + lane[3][c];
+        p += len;
+        n -= len;
+    }
+}
+
+// Counting sort in O(n): one histogram pass over st, then one pass filling the result run by run.
+// Buckets are visited in char order, so the result is the same as std::sort on the string. Below
+// 256 bytes walking the 256 buckets costs more than comparing, so those are left to std::sort.
+std::string counting_sort(std::string_view st, bool descending){
+    if(st.size() < 256){
+        std::string result(st);
+        if(descending)
+            std::sort(result.begin(), result.end(), std::greater<char>());
+        else
+            std::sort(result.begin(), result.end());
+        return result;
+    }
+    std::uint64_t count[256];
+    byte_histogram(st, count);
+    std::string result;
+    result.reserve(st.size());
+    for(int v = CHAR_MIN; v <= CHAR_MAX; v++){
+        char c = static_cast<char>(descending ? CHAR_MAX - (v - CHAR_MIN) : v);
+        std::uint64_t run = count[static_cast<unsigned char>(c)];
+        if(run != 0)
+            result.append(run, c);
+    }
+    return result;
+}
+
+// Counting sort the string acendingly, same result as Algorithm_0
+class Algorithm_3 : public AlgorithmBase {
+    public:
+        std::string doAlgorithm(std::string_view st) const override {
+            std::string result = process(st);
+            std::cout << result << ": Counting sorted acendingly\n";
+            return result;
+        }
+        std::string process(std::string_view st) const override {
+            return counting_sort(st, false);
+        }
+};
+
+// Counting sort the string decendingly, same result as Algorithm_1
+class Algorithm_4 : public AlgorithmBase {
+    public:
+        std::string doAlgorithm(std::string_view st) const override {
+            std::string result = process(st);
+            std::cout << result << ": Counting sorted decendingly\n";
+            return result;
+        }
+        std::string process(std::string_view st) const override {
+            return counting_sort(st, true);
+        }
+};
+
+// Reverse copy kernels, dst[i] = src[n - 1 - i]. Each one reads src from the back and writes dst from
+// the front, so the copy out of the string_view and the reverse are one pass over the data.
+void reverse_copy_scalar(const char *src, std::size_t n, char *dst){
+    std::size_t i = 0;
+    for(; i + 8 <= n; i += 8){                            // byte swap 8 bytes at a time
+        std::uint64_t w;
+        std::memcpy(&w, src + n - i - 8, 8);
+        w = __builtin_bswap64(w);
+        std::memcpy(dst + i, &w, 8);
+    }
+    for(; i < n; i++)
+        dst[i] = src[n - 1 - i];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+void reverse_copy_ssse3(const char *src, std::size_t n, char *dst){
+    const __m128i mask = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    std::size_t i = 0;
+    for(; i + 16 <= n; i += 16){
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + n - i - 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_shuffle_epi8(x, mask));
+    }
+    reverse_copy_scalar(src, n - i, dst + i);
+}
+
+__attribute__((target("avx2")))
+void reverse_copy_avx2(const char *src, std::size_t n, char *dst){
+    // vpshufb only shuffles within 128 bit lanes, reverse each lane and then swap the two lanes.
+    const __m256i mask = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                          15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    std::size_t i = 0;
+    for(; i + 64 <= n; i += 64){
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n - i - 32));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n - i - 64));
+        x = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(x, mask), 0x4e);
+        y = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(y, mask), 0x4e);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), x);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 32), y);
+    }
+    for(; i + 32 <= n; i += 32){
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + n - i - 32));
+        x = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(x, mask), 0x4e);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), x);
+    }
+    // The tail stays in this function. Jumping to reverse_copy_ssse3 here made gcc 12 drop the
+    // vzeroupper on the way out (it sees that the callee uses no 256 bit registers), so the caller
+    // was left with dirty upper halves. With no call the compiler puts one vzeroupper before ret.
+    if(i + 16 <= n){
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + n - i - 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_shuffle_epi8(x, _mm256_castsi256_si128(mask)));
+        i += 16;
+    }
+    if(i + 8 <= n){
+        std::uint64_t w;
+        std::memcpy(&w, src + n - i - 8, 8);
+        w = __builtin_bswap64(w);
+        std::memcpy(dst + i, &w, 8);
+        i += 8;
+    }
+    for(; i < n; i++)
+        dst[i] = src[n - 1 - i];
+}
+#endif
+
+typedef void (*ReverseCopy)(const char *src, std::size_t n, char *dst);
+
+// Picks the widest kernel the CPU runs, checked once on first use.
+ReverseCopy reverse_copy_kernel(){
+    static const ReverseCopy kernel = []{
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            return &reverse_copy_avx2;
+        if(__builtin_cpu_supports("ssse3"))
+            return &reverse_copy_ssse3;
+#endif
+        return &reverse_copy_scalar;
+    }();
+    return kernel;
+}
+
+std::string reverse_copy(std::string_view st, ReverseCopy kernel = reverse_copy_kernel()){
+    std::string result(st.size(), '\0');                // a write only pass, std::string has no uninitialised resize
+    kernel(st.data(), st.size(), result.data());
+    return result;
+}
+
+// Reverse the string with SSE/AVX2 byte shuffles, same result as Algorithm_2
+class Algorithm_5 : public AlgorithmBase {
+    public:
+        std::string doAlgorithm(std::string_view st) const override {
+            std::string result = process(st);
+            std::cout << result << ": String has be reversed by SIMD.\n";
+            return result;
+        }
+        std::string process(std::string_view st) const override {
+            return reverse_copy(st);
+        }
+};
+
+#define NUM_SIZE_BUCKETS 16      // bucket b holds inputs of 4^b to 4^(b+1) - 1 bytes, bucket 0 also empty ones, the last one everything above
+#define ONLINE_CALIBRATION_BYTES (std::size_t(1) << 20)     // runAdaptive() times candidates on at most this many bytes
+
 class Context {
     private:
         std::vector<std::unique_ptr<AlgorithmBase>> m_algorithm;
 
+        // Calibration result for one size bucket of an operation.
+        struct Bucket {
+            int winner = -1;                  // index of the fastest algorithm, -1 until calibrated
+            std::size_t sample_bytes = 0;     // input size the candidates were timed on
+            std::vector<double> ns;           // ns per call, one per candidate
+        };
+        // An operation several algorithms implement, runAdaptive() picks among its candidates.
+        struct Operation {
+            std::string name;
+            std::vector<int> candidates;
+            Bucket buckets[NUM_SIZE_BUCKETS];
+        };
+        std::vector<Operation> m_operations;
+
+        static int bucketOf(std::size_t bytes){
+            int b = 0;
+            while(b + 1 < NUM_SIZE_BUCKETS && (bytes >> (2 * (b + 1))) != 0)
+                b++;
+            return b;
+        }
+        Operation *findOperation(std::string_view name){
+            for(Operation &op : m_operations)
+                if(op.name == name)
+                    return &op;
+            return nullptr;
+        }
+        const Operation *findOperation(std::string_view name) const {
+            for(const Operation &op : m_operations)
+                if(op.name == name)
+                    return &op;
+            return nullptr;
+        }
+
+        // Times every candidate on st, best of rounds, and makes the fastest the bucket's winner.
+        // Small inputs are repeated so that a round covers at least 64 KB.
+        void calibrateBucket(Operation &op, Bucket &bucket, std::string_view st, int rounds){
+            bucket.sample_bytes = st.size();
+            bucket.ns.assign(op.candidates.size(), std::numeric_limits<double>::max());
+            std::size_t reps = std::max<std::size_t>(1, 65536 / (st.size() + 1));
+            for(int r = 0; r < rounds; r++)
+                for(std::size_t c = 0; c < op.candidates.size(); c++){
+                    const AlgorithmBase *algo = m_algorithm[op.candidates[c]].get();
+                    auto start = std::chrono::steady_clock::now();
+                    for(std::size_t i = 0; i < reps; i++)
+                        algo->process(st);
+                    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+                    bucket.ns[c] = std::min(bucket.ns[c], elapsed.count() / reps);
+                }
+            bucket.winner = op.candidates[std::min_element(bucket.ns.begin(), bucket.ns.end()) - bucket.ns.begin()];
+        }
+
+        // Winner of the bucket of bytes. Above ONLINE_CALIBRATION_BYTES an uncalibrated bucket takes the
+        // winner of the nearest calibrated one, the smaller on a tie. -1 when nothing fits.
+        int plannedWinner(const Operation &op, std::size_t bytes) const {
+            int b = bucketOf(bytes);
+            if(op.buckets[b].winner >= 0 || bytes <= ONLINE_CALIBRATION_BYTES)
+                return op.buckets[b].winner;
+            for(int d = 1; d < NUM_SIZE_BUCKETS; d++){
+                if(b - d >= 0 && op.buckets[b - d].winner >= 0)
+                    return op.buckets[b - d].winner;
+                if(b + d < NUM_SIZE_BUCKETS && op.buckets[b + d].winner >= 0)
+                    return op.buckets[b + d].winner;
+            }
+            return -1;
+        }
+
     public:
         void runAlgorithm(std::string_view st, int index){
             std::string ret = m_algorithm[index]->doAlgorithm(st);
@@ -78,7 +370,89 @@ class Context {
             if(abp)
                 m_algorithm.push_back(std::move(abp));
         }
+        // Adds abp and registers it as one of the candidates for operation.
+        void addAlgorithm(std::unique_ptr<AlgorithmBase> abp, std::string_view operation){
+            if(!abp)
+                return;
+            m_algorithm.push_back(std::move(abp));
+            Operation *op = findOperation(operation);
+            if(op == nullptr){
+                m_operations.emplace_back();
+                op = &m_operations.back();
+                op->name = std::string(operation);
+            }
+            op->candidates.push_back(numAlgorithms() - 1);
+            for(Bucket &bucket : op->buckets)             // a new candidate invalidates the plan
+                bucket = Bucket();
+        }
         AlgorithmBase *getAlgo(int index){ return m_algorithm[index].get();}
+        int numAlgorithms() const { return static_cast<int>(m_algorithm.size()); }
+        int numOperations() const { return static_cast<int>(m_operations.size()); }
+        const std::string &operationName(int index) const { return m_operations[index].name; }
+
+        // Startup calibration of every operation, for each bucket up to max_bytes on random bytes of
+        // twice the bucket's lower bound, best of 3.
+        void calibrate(std::size_t max_bytes = std::size_t(1) << 20){
+            std::mt19937 generator(42);
+            for(Operation &op : m_operations)
+                for(int b = 0; b < NUM_SIZE_BUCKETS && (std::size_t(1) << (2 * b)) <= max_bytes; b++){
+                    std::string sample(std::min(std::size_t(2) << (2 * b), max_bytes), '\0');
+                    for(char &c : sample)
+                        c = static_cast<char>(generator());
+                    calibrateBucket(op, op.buckets[b], sample, 3);
+                }
+        }
+
+        // Runs operation on st with the winner of st's size bucket. A bucket calibrate() did not cover
+        // is calibrated online, once, by timing every candidate on st itself. Above
+        // ONLINE_CALIBRATION_BYTES st is not timed, the winner of the nearest calibrated bucket runs; when
+        // there is none, the bucket of the first ONLINE_CALIBRATION_BYTES of st is calibrated on them.
+        std::string runAdaptive(std::string_view operation, std::string_view st){
+            Operation *op = findOperation(operation);
+            if(op == nullptr){
+                std::cout << "No algorithm for " << operation << "!\n";
+                return std::string();
+            }
+            int winner = plannedWinner(*op, st.size());
+            if(winner < 0){
+                std::string_view sample = st.substr(0, ONLINE_CALIBRATION_BYTES);
+                calibrateBucket(*op, op->buckets[bucketOf(sample.size())], sample, 1);
+                winner = plannedWinner(*op, st.size());
+            }
+            return m_algorithm[winner]->doAlgorithm(st);
+        }
+
+        // The menu and script numbers: 0 to numAlgorithms() - 1 run that algorithm, the numbers after
+        // them run the operations through runAdaptive(), in the order they were added.
+        int numChoices() const { return numAlgorithms() + numOperations(); }
+        std::string runChoice(int choice, std::string_view st){
+            if(choice < numAlgorithms())
+                return m_algorithm[choice]->doAlgorithm(st);
+            return runAdaptive(operationName(choice - numAlgorithms()), st);
+        }
+
+        // The algorithm runAdaptive() would use for bytes of input, -1 if it would calibrate first.
+        int chosen(std::string_view operation, std::size_t bytes) const {
+            const Operation *op = findOperation(operation);
+            return op == nullptr ? -1 : plannedWinner(*op, bytes);
+        }
+
+        // Prints the plan: per operation and calibrated bucket, every candidate's time and the winner.
+        void printPlan() const {
+            for(const Operation &op : m_operations){
+                std::cout << op.name << ":\n";
+                for(int b = 0; b < NUM_SIZE_BUCKETS; b++){
+                    const Bucket &bucket = op.buckets[b];
+                    if(bucket.winner < 0)
+                        continue;
+                    std::printf("  %10zu+ bytes (timed at %zu):", b == 0 ? std::size_t(0) : std::size_t(1) << (2 * b), bucket.sample_bytes);
+                    for(std::size_t c = 0; c < op.candidates.size(); c++)
+                        std::printf("  %d: %.0f ns", op.candidates[c], bucket.ns[c]);
+                    std::printf("  -> %d\n", bucket.winner);
+                }
+            }
+            std::fflush(stdout);
+        }
 };
 
 // Class handling user input from keyboard
@@ -113,12 +487,381 @@ class UserInput{
         }
 };
 
-int main(){
+// Reads a whole algorithm script instead of one number per prompt. A file is mapped read only, so is
+// stdin ("-") when it is redirected from a file, a pipe is read into a buffer. Numbers are separated
+// by white space or commas and '#' comments out the rest of the line. next_batch() parses them with
+// std::from_chars straight out of the buffer.
+class ScriptInput {
+    public:
+        ScriptInput() = default;
+        ScriptInput(const ScriptInput &) = delete;
+        ScriptInput &operator=(const ScriptInput &) = delete;
+        ~ScriptInput(){
+            if(m_map != nullptr)
+                ::munmap(m_map, m_length);
+        }
+
+        bool open(const char *path){
+            int fd = std::strcmp(path, "-") == 0 ? 0 : ::open(path, O_RDONLY);
+            if(fd < 0)
+                return false;
+            struct stat st{};
+            if(::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+                void *map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(map != MAP_FAILED){
+                    ::madvise(map, st.st_size, MADV_SEQUENTIAL);
+                    m_map = map;
+                    m_length = st.st_size;
+                    m_pos = static_cast<const char *>(map);
+                    m_end = m_pos + m_length;
+                }
+            }
+            if(m_map == nullptr){
+                char buf[65536];
+                ssize_t n;
+                while((n = ::read(fd, buf, sizeof(buf))) > 0)
+                    m_buffer.append(buf, n);
+                m_pos = m_buffer.data();
+                m_end = m_pos + m_buffer.size();
+            }
+            if(fd != 0)
+                ::close(fd);
+            return true;
+        }
+
+        // Parses up to max numbers into out, returns how many, 0 at the end of the script.
+        std::size_t next_batch(std::vector<int> &out, std::size_t max){
+            out.clear();
+            while(out.size() < max && m_pos < m_end){
+                if(separator(*m_pos)){
+                    m_pos++;
+                    continue;
+                }
+                if(*m_pos == '#'){
+                    const void *eol = std::memchr(m_pos, '\n', m_end - m_pos);
+                    m_pos = eol ? static_cast<const char *>(eol) : m_end;
+                    continue;
+                }
+                int value;
+                std::from_chars_result res = std::from_chars(m_pos, m_end, value);
+                if(res.ec == std::errc() && (res.ptr == m_end || separator(*res.ptr) || *res.ptr == '#')){
+                    out.push_back(value);
+                    m_pos = res.ptr;
+                }
+                else {                                   // not a number, skip the token
+                    m_bad++;
+                    while(m_pos < m_end && !separator(*m_pos))
+                        m_pos++;
+                }
+            }
+            return out.size();
+        }
+
+        std::size_t bad() const { return m_bad; }    // tokens that were not numbers
+
+    private:
+        static bool separator(char c) { return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == ','; }
+
+        void *m_map = nullptr;
+        std::size_t m_length = 0;
+        std::string m_buffer;
+        const char *m_pos = nullptr;
+        const char *m_end = nullptr;
+        std::size_t m_bad = 0;
+};
+
+#define SCRIPT_BATCH 4096                // algorithm numbers parsed per batch
+
+// Runs the algorithms named by a script on one string, the same numbers as the interactive loop,
+// adaptive choices included, 999 stops. Returns the number of algorithms run.
+std::size_t run_script(ScriptInput &script, Context &ctx, std::string_view st) {
+    std::vector<int> batch;
+    std::size_t handled = 0;
+    while(script.next_batch(batch, SCRIPT_BATCH) > 0)
+        for(int algo_num : batch){
+            if(algo_num == 999)
+                return handled;
+            if(algo_num < 0 || algo_num >= ctx.numChoices()){
+                std::cout << "Algorithm " << algo_num << " does not exist!\n";
+                continue;
+            }
+            ctx.runChoice(algo_num, st);
+            handled++;
+        }
+    return handled;
+}
+
+#ifdef RUN_BENCHMARK
+// 2M algorithm numbers, one per line, through ScriptInput, against reading the same file one number
+// at a time with >> and ignore(), which is what UserInput does. The algorithms print their result,
+// so output is muted while timing.
+void bench_script_input() {
+    const std::size_t num_events = 2000000;
+    const char *path = "/tmp/b_strategy_script.txt";
+    const std::string st = "interchangeable";
+    {
+        std::mt19937 generator(42);
+        std::string text;
+        for(std::size_t i = 0; i < num_events; i++){
+            text += static_cast<char>('0' + generator() % 6);
+            text += '\n';
+        }
+        std::FILE *fp = std::fopen(path, "wb");
+        if(fp == nullptr || std::fwrite(text.data(), 1, text.size(), fp) != text.size()){
+            std::cout << "can not write " << path << '\n';
+            return;
+        }
+        std::fclose(fp);
+    }
 
     Context ctx;
     ctx.addAlgorithm(std::make_unique<Algorithm_0>());
     ctx.addAlgorithm(std::make_unique<Algorithm_1>());
     ctx.addAlgorithm(std::make_unique<Algorithm_2>());
+    ctx.addAlgorithm(std::make_unique<Algorithm_3>());
+    ctx.addAlgorithm(std::make_unique<Algorithm_4>());
+    ctx.addAlgorithm(std::make_unique<Algorithm_5>());
+
+    std::cout.setstate(std::ios_base::badbit);
+    auto start = std::chrono::steady_clock::now();
+    std::ifstream in(path);
+    double user_in{};
+    std::size_t n_stream = 0;
+    while(in >> user_in){
+        in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        if(user_in >= 0 && user_in < ctx.numAlgorithms() && user_in == static_cast<int>(user_in)){
+            ctx.getAlgo(static_cast<int>(user_in))->doAlgorithm(st);
+            n_stream++;
+        }
+    }
+    std::chrono::duration<double> t_stream = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    ScriptInput script;
+    script.open(path);
+    std::size_t n_script = run_script(script, ctx, st);
+    std::chrono::duration<double> t_script = std::chrono::steady_clock::now() - start;
+    std::cout.clear();
+    std::remove(path);
+
+    std::cout << num_events << " algorithm runs on \"" << st << "\", end to end\n";
+    std::cout << ">> and ignore(): " << n_stream / t_stream.count() << " events/s\n";
+    std::cout << "ScriptInput:     " << n_script / t_script.count() << " events/s\n";
+}
+
+// Counting sort against std::sort on random bytes, 16 B to 1 GB in steps of 4x. Small sizes are
+// repeated to sort 64 MB in total. At 1 GB the input, the std::sort copy and the counting sort
+// result are all alive, 3 GB.
+void bench_counting_sort() {
+    std::mt19937_64 generator(42);
+    std::cout << "      bytes   std::sort MB/s   counting asc MB/s   counting desc MB/s\n";
+    for(std::size_t size = 16; size <= (std::size_t(1) << 30); size *= 4){
+        std::string input(size, '\0');
+        for(std::size_t i = 0; i < size; i += 8){
+            std::uint64_t w = generator();
+            std::memcpy(&input[i], &w, std::min<std::size_t>(8, size - i));
+        }
+        std::size_t reps = std::max<std::size_t>(1, (std::size_t(64) << 20) / size);
+        double mb = double(size) * reps / (1 << 20);
+        std::size_t check = 0;
+
+        std::string sorted;
+        auto start = std::chrono::steady_clock::now();
+        for(std::size_t r = 0; r < reps; r++){
+            sorted.assign(input);
+            std::sort(sorted.begin(), sorted.end());
+            check += static_cast<unsigned char>(sorted[r % size]);
+        }
+        std::chrono::duration<double> t_sort = std::chrono::steady_clock::now() - start;
+
+        std::string counted;
+        start = std::chrono::steady_clock::now();
+        for(std::size_t r = 0; r < reps; r++){
+            counted = counting_sort(input, false);
+            check += static_cast<unsigned char>(counted[r % size]);
+        }
+        std::chrono::duration<double> t_asc = std::chrono::steady_clock::now() - start;
+        if(counted != sorted)
+            std::cout << "counting sort differs from std::sort at " << size << " bytes!\n";
+        sorted.clear();
+        sorted.shrink_to_fit();
+
+        start = std::chrono::steady_clock::now();
+        for(std::size_t r = 0; r < reps; r++){
+            counted = counting_sort(input, true);
+            check += static_cast<unsigned char>(counted[r % size]);
+        }
+        std::chrono::duration<double> t_desc = std::chrono::steady_clock::now() - start;
+        if(!std::is_sorted(counted.begin(), counted.end(), [](char a, char b){ return a > b; }))
+            std::cout << "descending counting sort is not sorted at " << size << " bytes!\n";
+
+        std::printf("%11zu %16.1f %19.1f %20.1f\n", size, mb / t_sort.count(), mb / t_asc.count(), mb / t_desc.count());
+        if(check == 1)
+            std::cout << '\n';
+    }
+}
+
+// Reverse throughput in GB/s of input. std::reverse is what Algorithm_2 does, a copy then an in place
+// reverse. std::reverse_copy and the kernels are one pass. Each size is repeated to move 1 GB.
+void bench_reverse() {
+    struct Kernel { const char *name; ReverseCopy kernel; };
+    std::vector<Kernel> kernels{{"scalar", &reverse_copy_scalar}};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("ssse3"))
+        kernels.push_back({"ssse3", &reverse_copy_ssse3});
+    if(__builtin_cpu_supports("avx2"))
+        kernels.push_back({"avx2", &reverse_copy_avx2});
+#endif
+    std::mt19937 generator(42);
+    std::printf("%10s %14s %18s", "bytes", "std::reverse", "std::reverse_copy");
+    for(const Kernel &k : kernels)
+        std::printf(" %8s", k.name);
+    std::printf("   GB/s\n");
+
+    for(std::size_t size : {16, 100, 4096, 262144, 67108864}){
+        std::string input(size, '\0');
+        for(char &c : input)
+            c = static_cast<char>(generator());
+        std::string expect(input.rbegin(), input.rend());
+        std::size_t reps = std::max<std::size_t>(1, (std::size_t(1) << 30) / size);
+        double gb = double(size) * reps / 1e9;
+        std::size_t check = 0;
+
+        std::string result;
+        auto start = std::chrono::steady_clock::now();
+        for(std::size_t r = 0; r < reps; r++){
+            result = std::string(input);
+            std::reverse(result.begin(), result.end());
+            check += static_cast<unsigned char>(result[r % size]);
+        }
+        std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+        std::printf("%10zu %14.2f", size, gb / t.count());
+
+        start = std::chrono::steady_clock::now();
+        for(std::size_t r = 0; r < reps; r++){
+            result.resize(size);
+            std::reverse_copy(input.begin(), input.end(), result.begin());
+            check += static_cast<unsigned char>(result[r % size]);
+        }
+        t = std::chrono::steady_clock::now() - start;
+        std::printf(" %18.2f", gb / t.count());
+
+        for(const Kernel &k : kernels){
+            start = std::chrono::steady_clock::now();
+            for(std::size_t r = 0; r < reps; r++){
+                result = reverse_copy(input, k.kernel);
+                check += static_cast<unsigned char>(result[r % size]);
+            }
+            t = std::chrono::steady_clock::now() - start;
+            std::printf(" %8.2f", gb / t.count());
+            if(result != expect)
+                std::printf(" (%s differs!)", k.name);
+        }
+        std::printf("\n");
+        if(check == 1)
+            std::cout << '\n';
+    }
+}
+
+// Startup calibration cost, the plan it picks, and a workload of log uniform sizes from 1 byte to
+// 1 MB run through runAdaptive() against always using one algorithm. Output is muted while timing.
+void bench_adaptive() {
+    Context ctx;
+    ctx.addAlgorithm(std::make_unique<Algorithm_0>(), "sort ascending");
+    ctx.addAlgorithm(std::make_unique<Algorithm_2>(), "reverse");
+    ctx.addAlgorithm(std::make_unique<Algorithm_3>(), "sort ascending");
+    ctx.addAlgorithm(std::make_unique<Algorithm_5>(), "reverse");
+
+    auto start = std::chrono::steady_clock::now();
+    ctx.calibrate();
+    std::chrono::duration<double, std::milli> t_calibrate = std::chrono::steady_clock::now() - start;
+    std::cout << "calibration up to 1 MB: " << t_calibrate.count() << " ms\n";
+    ctx.printPlan();
+
+    std::mt19937 generator(7);
+    std::vector<std::string> inputs(2000);
+    for(std::string &input : inputs){
+        input.resize(std::size_t(1) << (generator() % 21));
+        for(char &c : input)
+            c = static_cast<char>(generator());
+    }
+    struct Run { const char *operation; int fixed[2]; };
+    for(const Run &run : {Run{"sort ascending", {0, 2}}, Run{"reverse", {1, 3}}}){
+        std::cout.setstate(std::ios_base::badbit);
+        start = std::chrono::steady_clock::now();
+        for(const std::string &input : inputs)
+            ctx.runAdaptive(run.operation, input);
+        std::chrono::duration<double, std::milli> t_adaptive = std::chrono::steady_clock::now() - start;
+        double t_fixed[2];
+        for(int f = 0; f < 2; f++){
+            start = std::chrono::steady_clock::now();
+            for(const std::string &input : inputs)
+                ctx.runAlgorithm(input, run.fixed[f]);
+            t_fixed[f] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        std::cout.clear();
+        std::cout << run.operation << ", " << inputs.size() << " inputs: adaptive " << t_adaptive.count()
+                  << " ms, always " << run.fixed[0] << " " << t_fixed[0] << " ms, always " << run.fixed[1]
+                  << " " << t_fixed[1] << " ms\n";
+    }
+}
+#endif
+
+static int usage(const char *prog){
+    std::cout << "usage: " << prog << "                                  interactive\n"
+              << "       " << prog << " --plan [max bytes]               calibrate and print the plan\n"
+              << "       " << prog << " --script <file or -> <string>    run a script on string\n";
+    return 1;
+}
+
+int main(int argc, char *argv[]){
+
+    Context ctx;
+    ctx.addAlgorithm(std::make_unique<Algorithm_0>(), "sort ascending");
+    ctx.addAlgorithm(std::make_unique<Algorithm_1>(), "sort descending");
+    ctx.addAlgorithm(std::make_unique<Algorithm_2>(), "reverse");
+    ctx.addAlgorithm(std::make_unique<Algorithm_3>(), "sort ascending");
+    ctx.addAlgorithm(std::make_unique<Algorithm_4>(), "sort descending");
+    ctx.addAlgorithm(std::make_unique<Algorithm_5>(), "reverse");
+
+    if(argc > 1 && std::strcmp(argv[1], "--plan") == 0){         // b_strategy --plan [max bytes]
+        std::size_t max_bytes = std::size_t(1) << 20;
+        if(argc > 3)
+            return usage(argv[0]);
+        if(argc == 3){
+            const char *end = argv[2] + std::strlen(argv[2]);
+            std::from_chars_result res = std::from_chars(argv[2], end, max_bytes);
+            if(res.ec != std::errc() || res.ptr != end || max_bytes == 0)
+                return usage(argv[0]);
+        }
+        ctx.calibrate(max_bytes);
+        ctx.printPlan();
+        return 0;
+    }
+
+    if(argc > 1 && std::strcmp(argv[1], "--script") == 0){       // b_strategy --script <file or -> <string>
+        if(argc != 4)
+            return usage(argv[0]);
+        ScriptInput script;
+        if(!script.open(argv[2])){
+            std::cout << "can not open " << argv[2] << '\n';
+            return 1;
+        }
+        std::size_t handled = run_script(script, ctx, argv[3]);
+        std::cout << handled << " algorithms run, " << script.bad() << " invalid tokens\n";
+        return 0;
+    }
+    if(argc > 1)
+        return usage(argv[0]);
+
+#ifdef RUN_BENCHMARK
+    bench_script_input();
+    bench_counting_sort();
+    bench_reverse();
+    bench_adaptive();
+    return 0;
+#endif
 
     std::cout << "Type in a string(UTF-8) and then pick an algorithm to process it:";
     std::string user_str{};
@@ -129,37 +872,28 @@ int main(){
     double user_in{};
     while(true){
         while(true){
-            std::cout << "\nPick an algorithm: 0, 1, or 2 \n";
-            std::cout << "0: Sort the string decendingly;\n";
-            std::cout << "1: Sort the string acendingly; \n";
+            std::cout << "\nPick an algorithm: 0 to " << ctx.numChoices() - 1 << " \n";
+            std::cout << "0: Sort the string acendingly; \n";
+            std::cout << "1: Sort the string decendingly; \n";
             std::cout << "2: Reverse the string; \n";
+            std::cout << "3: Counting sort the string acendingly; \n";
+            std::cout << "4: Counting sort the string decendingly; \n";
+            std::cout << "5: Reverse the string with SIMD; \n";
+            for(int op = 0; op < ctx.numOperations(); op++)
+                std::cout << ctx.numAlgorithms() + op << ": Adaptive " << ctx.operationName(op)
+                          << ", the fastest algorithm for the string's length; \n";
             std::cout << "999 : quit the program; \n\n";
 
             user_in = uinput.getNumber();
             if(user_in == 999)
                 return 0;
-            if(user_in == 0 || user_in == 1 || user_in == 2)
+            if(user_in >= 0 && user_in < ctx.numChoices() && user_in == static_cast<int>(user_in))
                 break;
             else
                 std::cout << "Algorithm does not exist! Try again\n";
         }
       
-        int algo_num = static_cast<int>(user_in);
-        switch(algo_num){
-            case 0:
-                ctx.getAlgo(algo_num)->doAlgorithm(user_str);
-                break;
-            case 1:
-                ctx.getAlgo(algo_num)->doAlgorithm(user_str);
-                break;
-
-            case 2:
-                ctx.getAlgo(algo_num)->doAlgorithm(user_str);
-                break;
-            default:
-                std::cout << "No algorithm found\n";
-                break;
-        };
+        ctx.runChoice(static_cast<int>(user_in), user_str);
     }
     
     return 0;